@@ -0,0 +1,145 @@
+#include <poll.h>
+
+#include <exception>
+
+#include "log4cpp.h"
+#include "timespec.h"
+
+#include "busloop.h"
+
+busloop::wait::wait(busloop &loop, int fd, short events,
+					const struct timespec *deadline)
+	: m_loop(loop) {
+	m_w.fd = fd;
+	m_w.events = events;
+	if(deadline)
+		m_w.deadline = *deadline;
+	else
+		m_w.deadline.tv_sec = m_w.deadline.tv_nsec = 0;
+	m_w.revents = 0;
+	m_w.timed_out = false;
+}
+
+void busloop::wait::await_suspend(std::coroutine_handle<> h) {
+	m_w.h = h;
+	m_loop.m_waiting.push_back(&m_w);
+}
+
+busloop::wait busloop::readable(int fd, const struct timespec &deadline) {
+	return wait(*this, fd, POLLIN, &deadline);
+}
+
+busloop::wait busloop::writable(int fd) {
+	return wait(*this, fd, POLLOUT, NULL);
+}
+
+busloop::wait busloop::until(const struct timespec &when) {
+	return wait(*this, -1, 0, &when);
+}
+
+busloop::wait busloop::after(long ms) {
+	struct timespec when;
+	clock_gettime(CLOCK_MONOTONIC, &when);
+	when += ms;
+	return wait(*this, -1, 0, &when);
+}
+
+void busloop::post(std::coroutine_handle<> h) {
+	m_ready.push_back(h);
+}
+
+void busloop::spawn(task<void> &&t) {
+	m_tasks.push_back(std::move(t));
+	post(m_tasks.back().coroutine());
+}
+
+void busloop::wake(void) {
+	// Wait for the first fd or deadline (or none, if something's ready)
+	std::vector<struct pollfd> fds;
+	std::vector<waiter *> polled;
+	struct timespec first = { 0, 0 };
+	for(auto w = m_waiting.begin(); w != m_waiting.end(); w++) {
+		if((*w)->fd >= 0) {
+			struct pollfd p;
+			p.fd = (*w)->fd;
+			p.events = (*w)->events;
+			p.revents = 0;
+			fds.push_back(p);
+			polled.push_back(*w);
+		}
+		const struct timespec &d = (*w)->deadline;
+		if((d.tv_sec || d.tv_nsec) &&
+		   ((first.tv_sec == 0 && first.tv_nsec == 0) || d < first))
+			first = d;
+	}
+
+	struct timespec now, wait, *waitp = NULL;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if(!m_ready.empty()) {
+		wait.tv_sec = wait.tv_nsec = 0;
+		waitp = &wait;
+	}
+	else if(first.tv_sec || first.tv_nsec) {
+		if(now < first)
+			wait = first - now;
+		else
+			wait.tv_sec = wait.tv_nsec = 0;
+		waitp = &wait;
+	}
+	ppoll(fds.data(), fds.size(), waitp, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	// Who's due: ready, their fd is, or out of time
+	std::vector<std::coroutine_handle<> > due;
+	due.swap(m_ready);
+	for(size_t i = 0; i < fds.size(); i++)
+		polled[i]->revents = fds[i].revents; // (errors, too: the read
+											 // or write will say)
+	for(auto w = m_waiting.begin(); w != m_waiting.end();) {
+		const struct timespec &d = (*w)->deadline;
+		if((*w)->revents)
+			;
+		else if((d.tv_sec || d.tv_nsec) && now >= d)
+			(*w)->timed_out = true;
+		else {
+			w++;
+			continue;
+		}
+		due.push_back((*w)->h);
+		w = m_waiting.erase(w);
+	}
+
+	for(auto h = due.begin(); h != due.end(); h++)
+		h->resume();
+}
+
+void busloop::run(void) {
+	log4cpp::Category &root = log4cpp::Category::getRoot();
+	while(!m_tasks.empty()) {
+		if(m_waiting.empty() && m_ready.empty()) {
+			root.error("busloop: %zu tasks, all stuck", m_tasks.size());
+			return;
+		}
+		wake();
+
+		for(auto t = m_tasks.begin(); t != m_tasks.end();) {
+			if(!t->done()) {
+				t++;
+				continue;
+			}
+			try {
+				t->coroutine().promise().result();
+			}
+			catch(const std::exception &e) {
+				root.error("busloop: task failed, %s", e.what());
+			}
+			t = m_tasks.erase(t);
+		}
+	}
+}
+
+void *busloop_run(void *param) {
+	busloop *loop = (busloop *)param;
+	loop->run();
+	return 0;
+}
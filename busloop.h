@@ -0,0 +1,66 @@
+#ifndef BUSLOOP_H
+#define BUSLOOP_H
+
+// One thread driving any number of buses, none of it blocking: each
+// bus is a coroutine (busprotocol::co_run) that co_awaits its port
+// becoming writable or readable, or a moment in time (the turnaround
+// hold-off, a reply deadline, a PD's "wait this long"), and the loop
+// resumes it when that comes.  It's ppoll() underneath, so it's
+// microsecond-timed and good for a handful of ports; more than that
+// would want epoll.
+
+#include <time.h>
+
+#include <coroutine>
+#include <list>
+#include <vector>
+
+#include "task.h"
+
+class busloop {
+protected:
+	// A coroutine waiting on me
+	struct waiter {
+		std::coroutine_handle<> h;
+		int fd;					// for this (or -1: just the time)
+		short events;			// POLLIN or POLLOUT
+		short revents;			// (what ppoll said)
+		struct timespec deadline; // until this (0: no limit)
+		bool timed_out;
+	};
+	std::vector<waiter *> m_waiting;
+	std::vector<std::coroutine_handle<> > m_ready; // to resume next time
+	std::list<task<void> > m_tasks;	// spawned, not yet done
+
+	void wake(void);			// resume what's due, once
+
+public:
+	// co_await one of these; it says true, or false if the deadline
+	// came first.  (They belong to the co_await expression, so there's
+	// nothing to clean up.)
+	class wait {
+	protected:
+		busloop &m_loop;
+		waiter m_w;
+	public:
+		wait(busloop &loop, int fd, short events,
+			 const struct timespec *deadline);
+		bool await_ready() const noexcept { return false; }
+		void await_suspend(std::coroutine_handle<> h);
+		bool await_resume() const noexcept { return !m_w.timed_out; }
+	};
+	wait readable(int fd, const struct timespec &deadline);
+	wait writable(int fd);		// (no deadline)
+	wait until(const struct timespec &when);
+	wait after(long ms);		// (from now)
+
+	void post(std::coroutine_handle<> h); // resume h, next time 'round
+	void spawn(task<void> &&t);	// start t (next time 'round), and hold
+								// it until it's done
+
+	void run(void);				// until there's nothing left to do
+};
+
+void *busloop_run(void *param);	// (thread main)
+
+#endif // BUSLOOP_H
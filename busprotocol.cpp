@@ -0,0 +1,1385 @@
+#include <unistd.h>
+#include <pthread.h>
+
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+
+#include "osdpslave.h"
+#include "busprotocol.h"
+#include "osdpcodes.h"
+
+#include "timespec.h"
+
+using namespace std;
+
+void logprotocol::datalog(const char *prefix, const uint8_t *buffer, int len) {
+	// Since log4cpp insists every log is a line,
+	// build whole lines
+	while(len > 0) {
+		int somelen = len;
+		if(somelen > 16)
+			somelen = 16;
+		std::ostringstream line;
+		line.fill('0');
+		line.setf(ios::hex|ios::uppercase,
+				  ios::basefield|ios::uppercase);
+		const char *space = "";
+		for(int i = 0; i < somelen; i++) {
+			line << space << setw(2) << (int)buffer[i];
+			space = " ";
+		}
+				
+		log4cpp::Category &root = log4cpp::Category::getRoot();
+		root.debug("%s: %s", prefix, line.str().c_str());
+
+		buffer += somelen;
+		len -= somelen;
+	}
+}
+
+osdpslave &busprotocol::add_slave(const char *addr) {
+	// A static slave.  (No address means it's known by UUID, and
+	// discovery will find its address.)
+	uint32_t a = addr ? strtoul(addr, NULL, 10) : 0xFF;
+	m_slaves.push_back(osdpslave(this));
+	osdpslave &s = m_slaves.back();
+	s.addr(a);
+	s.init();
+
+	m_poll_slave = m_slaves.begin();
+	return s;
+}
+
+qpolicy_t busprotocol::admit(size_t bytes, const char **why) {
+	if(m_max_msgs > 0 && (size_t)m_queued + 1 > m_max_msgs) {
+		*why = "bus msgs";
+		return m_policy;
+	}
+	if(m_max_bytes > 0 && (size_t)m_queued_bytes + bytes > m_max_bytes) {
+		*why = "bus bytes";
+		return m_policy;
+	}
+	return QUEUE_ADMIT;
+}
+
+void busprotocol::stats_report(void) {
+	char text[512];
+	for(auto i = m_slaves.begin(); i != m_slaves.end(); i++) {
+		if(!i->defined())
+			continue;
+		int len = i->stats(text, sizeof(text));
+		transport()->report(*i, "stats", text, len);
+	}
+
+	// Whatever time I didn't account for went to "other" (discovery,
+	// reopening the port, my own overhead...)
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	struct timespec dt = now - m_airtime_start;
+	long interval = dt.tv_sec * 1000000 + dt.tv_nsec / 1000;
+	long other = interval;
+	for(int c = 0; c < AIR_CATEGORIES; c++)
+		other -= m_airtime[c];
+	if(other < 0)
+		other = 0;
+
+	int len = snprintf(text, sizeof(text),
+					   "{\"queued\":%d,\"queued_bytes\":%d,"
+					   "\"crc_errors\":%d,\"timeouts\":%d,\"echoed\":%ld,"
+					   "\"interval_us\":%ld,\"payload_share\":%.3f,"
+					   "\"airtime\":",
+					   (int)m_queued, (int)m_queued_bytes,
+					   (int)m_crc_count, (int)m_timeout_count, echoed(),
+					   interval,
+					   interval ? (double)m_airtime[AIR_PAYLOAD] / interval : 0.0);
+	for(int c = 0; c < AIR_CATEGORIES; c++) {
+		len += snprintf(text + len, sizeof(text) - len, "%c\"%s_us\":%ld",
+						c ? ',' : '{', aircat_names[c], m_airtime[c]);
+		m_airtime[c] = 0;
+	}
+	len += snprintf(text + len, sizeof(text) - len, ",\"other_us\":%ld}}",
+					other);
+	transport()->report("stats", -1, text, len);
+
+	// (Beside them: there's no more room in those)
+	if(m_journal) {
+		len = m_journal->usage(text, sizeof(text));
+		transport()->report("journal", -1, text, len);
+	}
+	m_airtime_start = now;
+}
+
+void busprotocol::exchanged(osdpslave &s, int size, bool sendmsg,
+							aircat_t kind) {
+	// An exchange is the hold-off, the command, the wait, and the
+	// reply (if any).  The wire times are exact, from the frame
+	// lengths; the wait is what's left of the elapsed time.
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	struct timespec dt = now - tx_start();
+	long tx = wire_us(tx_bytes());
+	long rx = size > 0 ? wire_us(size + 2) : 0; // (+CRC)
+	long wait = dt.tv_sec * 1000000 + dt.tv_nsec / 1000 - tx - rx;
+	if(wait < 0)
+		wait = 0;
+
+	long air[AIR_CATEGORIES];
+	memset(air, 0, sizeof(air));
+	air[AIR_DELAY] = take_delayed();
+	if(kind == AIR_PROBE || kind == AIR_RETRY)
+		air[kind] = tx + wait + rx;	// (all of it)
+	else {
+		air[sendmsg ? AIR_PAYLOAD : AIR_POLL] += tx;
+		if(size > 5 && m_in_buffer[5] != OSDP_ACK)
+			air[AIR_PAYLOAD] += rx;	// it had something to say
+		else
+			air[AIR_POLL] += rx;
+		air[size > 0 ? AIR_TURNAROUND : AIR_TIMEOUT] = wait;
+	}
+	for(int c = 0; c < AIR_CATEGORIES; c++) {
+		s.m_airtime[c] += air[c];
+		m_airtime[c] += air[c];
+	}
+}
+
+void busprotocol::index_slave(osdpslave &s) {
+	boost::lock_guard<boost::mutex> lock(m_index_lock);
+	if(s.addr() < 128)
+		m_by_addr[s.addr()] = &s;
+	if(!mem_zero(s.uuid(), sizeof(uuid_t)))
+		m_by_uuid[uuid_key(s.uuid())] = &s;
+}
+
+void busprotocol::unindex_slave(osdpslave &s) {
+	// Only remove entries that are really mine; a copy of a
+	// slave may share my address or UUID.
+	boost::lock_guard<boost::mutex> lock(m_index_lock);
+	if(s.addr() < 128 && m_by_addr[s.addr()] == &s)
+		m_by_addr[s.addr()] = NULL;
+	if(!mem_zero(s.uuid(), sizeof(uuid_t))) {
+		auto i = m_by_uuid.find(uuid_key(s.uuid()));
+		if(i != m_by_uuid.end() && i->second == &s)
+			m_by_uuid.erase(i);
+	}
+}
+
+osdpslave *busprotocol::find_slave(uint8_t addr) {
+	if(addr >= 128)
+		return NULL;
+	boost::lock_guard<boost::mutex> lock(m_index_lock);
+	return m_by_addr[addr];
+}
+
+osdpslave *busprotocol::find_slave(const uuid_t uuid) {
+	boost::lock_guard<boost::mutex> lock(m_index_lock);
+	auto i = m_by_uuid.find(uuid_key(uuid));
+	if(i == m_by_uuid.end())
+		return NULL;
+	return i->second;
+}
+
+// PDs don't report a UUID, so I derive one from the parts of the PDID
+// that identify the unit: vendor code, model and serial number.  The
+// same PD gets the same UUID at any address, and firmware upgrades
+// don't change it.
+static const uuid_t pdid_namespace = {
+	0x6f, 0x73, 0x64, 0x70, 0x2d, 0x70, 0x64, 0x69,
+	0x64, 0x2d, 0x6e, 0x61, 0x6d, 0x65, 0x73, 0x70
+};
+
+static void pdid_uuid(const uint8_t *pdid, uuid_t u) {
+	// PDID: code, vendor[3], model, version, serial[4], firmware[3]
+	char name[8];
+	memcpy(name, pdid + 1, 4);	// vendor, model
+	memcpy(name + 4, pdid + 6, 4); // serial
+	uuid_generate_sha1(u, pdid_namespace, name, sizeof(name));
+}
+
+int busprotocol::probe_id(uint8_t addr, uint8_t seq, long *reply_us) {
+	unsigned char idmsg[2];
+	idmsg[0] = OSDP_ID;
+	idmsg[1] = 0x00;			// "standard PDID report"
+	flush_input();
+	writecook(addr, seq, sizeof(idmsg), idmsg);
+
+	struct timespec sent, heard;
+	clock_gettime(CLOCK_MONOTONIC, &sent);
+	int size = readcook();
+	clock_gettime(CLOCK_MONOTONIC, &heard);
+	heard -= sent;
+	*reply_us = heard.tv_sec * 1000000 + heard.tv_nsec / 1000;
+	if(size > 0)
+		m_timeout_run = 0;		// (the port's fine)
+	if(size > 0 && (size < 5 + 13 || m_in_buffer[5] != OSDP_PDID))
+		size = PROTO_ERR_NOEOD;	// answered, but not with a PDID
+	return size;
+}
+
+void busprotocol::discovered(uint8_t addr, long reply_us) {
+	log4cpp::Category &root = log4cpp::Category::getRoot();
+	const uint8_t *pdid = m_in_buffer + 5;
+	discovered_t &d = m_discovered[addr];
+	d.found = true;
+	d.reply_us = reply_us;
+	pdid_uuid(pdid, d.uuid);
+
+	osdpslave *s = find_slave(addr);
+	if(s)
+		s->m_reply_us = reply_us;
+
+	char sayuuid[37];
+	uuid_unparse(d.uuid, sayuuid);
+	char text[256];
+	int len = snprintf(text, sizeof(text),
+					   "{\"addr\":%d,\"uuid\":\"%s\",\"vendor\":\"%02X%02X%02X\","
+					   "\"model\":%d,\"version\":%d,\"serial\":%lu,"
+					   "\"firmware\":\"%d.%d.%d\",\"reply_us\":%ld}",
+					   (int)addr, sayuuid, pdid[1], pdid[2], pdid[3],
+					   pdid[4], pdid[5],
+					   (unsigned long)(pdid[6] | (pdid[7] << 8) |
+									   (pdid[8] << 16) | ((uint32_t)pdid[9] << 24)),
+					   pdid[10], pdid[11], pdid[12], reply_us);
+	root.info("Discovered %s", text);
+	transport()->discovered(addr, text, len);
+}
+
+void busprotocol::port_report(void) {
+	char text[128];
+	int len = usb_report(text, sizeof(text));
+	transport()->report("port", -1, text, len);
+}
+
+void busprotocol::latency_check(void) {
+	log4cpp::Category &root = log4cpp::Category::getRoot();
+
+	// Someone to ask: the first slave that answers an ID
+	osdpslave *s = NULL;
+	long us;
+	for(auto i = m_slaves.begin(); i != m_slaves.end() && s == NULL; i++)
+		if(i->defined() && i->addressed() && i->enabled() &&
+		   probe_id(i->addr(), 0, &us) > 0)
+			s = &*i;
+	if(s == NULL) {
+		root.warn("Latency check: no PD answered on bus %d", m_busno);
+		return;
+	}
+
+	// Time the same exchange as the port came, then as I tuned it
+	long avg[2], most[2];
+	int n[2];
+	for(int tuned = 0; tuned < 2; tuned++) {
+		low_latency(tuned);
+		avg[tuned] = most[tuned] = n[tuned] = 0;
+		for(int i = 0; i < m_latency_check; i++) {
+			if(probe_id(s->addr(), 0, &us) <= 0)
+				continue;
+			avg[tuned] += us;
+			if(us > most[tuned])
+				most[tuned] = us;
+			n[tuned]++;
+		}
+		if(n[tuned])
+			avg[tuned] /= n[tuned];
+	}
+
+	char text[256];
+	int len = snprintf(text, sizeof(text),
+					   "{\"addr\":%d,\"before\":{\"n\":%d,\"avg_us\":%ld,"
+					   "\"max_us\":%ld},\"after\":{\"n\":%d,\"avg_us\":%ld,"
+					   "\"max_us\":%ld}}",
+					   (int)s->addr(), n[0], avg[0], most[0],
+					   n[1], avg[1], most[1]);
+	root.info("Latency check %s", text);
+	transport()->report("latency_check", -1, text, len);
+}
+
+void busprotocol::discover(void) {
+	log4cpp::Category &root = log4cpp::Category::getRoot();
+	root.info("Discovering PDs on bus %d", m_busno);
+
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	memset(m_discovered, 0, sizeof(m_discovered));
+	long saved_timeout = timeout(m_discover_timeout);
+	long us;
+
+	// First, ask everyone at once.  If exactly one PD is out there,
+	// its reply is all I need.  Several answering at once garble each
+	// other (or a second reply follows the first), and some PDs
+	// ignore broadcasts; in those cases, sweep.
+	bool sweep = true;
+	int size = probe_id(0x7F, 0, &us);
+	if(size > 0) {
+		uint8_t a = m_in_buffer[1] & 0x7F;
+		if(a < 0x7F) {
+			discovered(a, us);
+			if(readcook() == PROTO_ERR_TIMEOUT)
+				sweep = false;	// nobody else spoke up
+		}
+	}
+
+	for(int a = 0; sweep && a < 0x7F; a++) {
+		// A slave I'm already talking to keeps its sequence going
+		osdpslave *s = find_slave(a);
+		bool online = s && s->enabled() && !s->offline();
+		for(int attempt = 0; attempt < 2; attempt++) {
+			size = probe_id(a, online ? s->txseq() : 0, &us);
+			if(size > 0) {
+				if((m_in_buffer[1] & 0x7F) != a)
+					break;		// (someone else answered?)
+				if(online)
+					s->ack();
+				discovered(a, us);
+				break;
+			}
+			if(size == PROTO_ERR_TIMEOUT)
+				break;			// silence: nobody's there
+			// Garbled: something's there; ask once more.
+		}
+	}
+
+	timeout(saved_timeout);
+
+	// Slaves configured by UUID now learn their addresses
+	int found = 0;
+	for(int a = 0; a < 0x7F; a++)
+		if(m_discovered[a].found)
+			found++;
+	for(auto i = m_slaves.begin(); i != m_slaves.end(); i++) {
+		if(!mem_zero(i->uuid(), sizeof(uuid_t)))
+			id_slave(i->uuid());
+	}
+
+	struct timespec elapsed;
+	clock_gettime(CLOCK_MONOTONIC, &elapsed);
+	elapsed -= start;
+	char text[64];
+	int len = snprintf(text, sizeof(text), "{\"found\":%d,\"elapsed_ms\":%ld}",
+					   found, to_ms(elapsed));
+	root.info("Discovery found %d PDs in %ld ms", found, to_ms(elapsed));
+	transport()->discovered(-1, text, len);
+}
+
+bool busprotocol::id_slave(const uuid_t uuid) {
+	// Find the PD with this UUID in the last sweep, and give its
+	// address to the slave configured with the UUID.
+	for(int a = 0; a < 0x7F; a++) {
+		discovered_t &d = m_discovered[a];
+		if(!d.found || uuid_compare(d.uuid, uuid) != 0)
+			continue;
+		osdpslave *s = find_slave(uuid);
+		if(s && s->addr() != a) {
+			log4cpp::Category &root = log4cpp::Category::getRoot();
+			osdpslave *other = find_slave(a);
+			if(other && other != s) {
+				root.error("UUID slave found at %d, but that address is taken", a);
+				return false;
+			}
+			root.info("UUID slave found at address %d", a);
+			s->addr(a);
+			s->m_reply_us = d.reply_us;
+		}
+		return s != NULL;
+	}
+	return false;
+}
+
+void busprotocol::init(void) {
+	// add_slave already took care of this
+}
+
+void *busprotocol_run(void *param) {
+	busprotocol *proto = (busprotocol *)param;
+	try {
+		proto->run();
+	}
+	catch(std::exception &e) {
+		cerr << e.what() << endl;
+	}
+	return 0;
+}
+
+void busprotocol::open_port(void) {
+	log4cpp::Category &root = log4cpp::Category::getRoot();
+
+	close_standby();
+	bool first = true;
+	while(!open_either()) {
+		if(first) {
+			root.error("Failed to open %s, waiting...", m_config.port);
+			first = false;
+		}
+		// Until a device node turns up (or a while goes by: it might
+		// be there, and busy)
+		m_devwatch->wait(5000);
+		m_devwatch->take(m_config.port);
+		m_devwatch->take(port2());
+	}
+	opened();
+}
+
+bool busprotocol::open_either(void) {
+	if(m_devwatch == NULL) {
+		m_devwatch = new devwatch();
+		m_devwatch->watch(m_config.port);
+		if(port2())
+			m_devwatch->watch(port2());
+	}
+
+	// Connect & prepare to run the port (either one)
+	if(try_prepcom())
+		return true;
+	if(port2()) {
+		swap_ports();
+		if(try_prepcom())
+			return true;
+	}
+	return false;
+}
+
+void busprotocol::opened(void) {
+	log4cpp::Category &root = log4cpp::Category::getRoot();
+	if(port2()) {
+		m_standby_up = open_standby();
+		root.info("Standby port %s %s", port2(),
+				  m_standby_up ? "ready" : "not there (yet)");
+		clock_gettime(CLOCK_MONOTONIC, &m_standby_next);
+		m_standby_next += m_standby_check;
+	}
+}
+
+bool busprotocol::hotplug(void) {
+	log4cpp::Category &root = log4cpp::Category::getRoot();
+	if(!m_devwatch->wait(0))
+		return true;
+	if(port2() && m_devwatch->take(port2()))
+		m_standby_next.tv_sec = 0; // (check it now)
+	if(m_devwatch->take(m_config.port) & DEV_GONE) {
+		root.error("Port %s is gone", m_config.port);
+		return false;
+	}
+	return true;
+}
+
+bool busprotocol::failover(const char *why, const struct timespec &since) {
+	log4cpp::Category &root = log4cpp::Category::getRoot();
+	if(!standby_ok())
+		return false;			// Nowhere to go
+
+	// Switch.  The slaves don't notice: sequence numbers, queues and
+	// what's awaiting an answer carry on as they were.
+	const char *from = m_config.port;
+	swap_ports();
+	close_standby();			// (check_standby reopens it)
+	m_standby_up = false;
+	m_timeout_run = 0;
+	m_failovers++;
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	struct timespec took = now - since;
+	long us = took.tv_sec * 1000000 + took.tv_nsec / 1000;
+	m_standby_next = now;
+	m_standby_next += m_standby_check;
+
+	char text[512];
+	int len = snprintf(text, sizeof(text),
+					   "{\"from\":\"%s\",\"to\":\"%s\",\"reason\":\"%s\","
+					   "\"failover_us\":%ld,\"failovers\":%ld}",
+					   from, m_config.port, why, us, m_failovers);
+	root.warn("Failed over %s", text);
+	transport()->report("failover", -1, text, len);
+	return true;
+}
+
+bool busprotocol::all_offline(void) const {
+	for(auto i = m_slaves.begin(); i != m_slaves.end(); i++)
+		if(i->defined() && i->addressed() && i->enabled() && !i->offline())
+			return false;
+	return true;
+}
+
+void busprotocol::check_standby(const struct timespec &now) {
+	log4cpp::Category &root = log4cpp::Category::getRoot();
+	if(port2() == NULL || now < m_standby_next)
+		return;
+	m_standby_next = now;
+	m_standby_next += m_standby_check;
+
+	bool up = standby_ok() || open_standby();
+	if(up != m_standby_up)
+		root.warn("Standby port %s %s", port2(), up ? "ready" : "lost");
+	m_standby_up = up;
+}
+
+void busprotocol::started(const char *engine) {
+	log4cpp::Category &root = log4cpp::Category::getRoot();
+	root.error("Port %s opened%s", m_config.port, engine);
+	root.error("m_config.delay = %ld", m_config.delay);
+	root.error("m_config.timeout = %ld", m_config.timeout);
+	if(m_config.usb && !m_monitor) {
+		port_report();
+		if(m_latency_check > 0) {
+			try {
+				latency_check();
+			}
+			catch(const protocol_exception &e) {
+				root.error("Error during latency check, %s", e.what());
+			}
+			take_delayed();		// (that's not any slave's time)
+		}
+	}
+}
+
+void busprotocol::before_turn(void) {
+	log4cpp::Category &root = log4cpp::Category::getRoot();
+	if(m_monitor)
+		return;					// (I never transmit)
+
+	if(m_discover) {
+		m_discover = 0;
+		try {
+			discover();
+			take_delayed();		// (that's not any slave's time)
+		}
+		catch(const protocol_exception &e) {
+			root.error("Error during discovery, %s", e.what());
+		}
+	}
+
+	/*
+	 * There's a queue of outgoing messages per slave, and
+	 * there's a bus-global queue.  The bus-global queue is for
+	 * address-assignment messages and inquiries, and
+	 * I give it precedence.
+	 */
+
+	if(m_shm)
+		shm_commands();
+}
+
+bool busprotocol::port_error(const protocol_exception &e) {
+	log4cpp::Category &root = log4cpp::Category::getRoot();
+	root.error("Error while polling, %s", e.what());
+
+	// I/O error (like, unplugged USB cable)
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return !failover("I/O error", now);
+}
+
+void busprotocol::after_turn(void) {
+	if(m_failover_timeouts > 0 &&
+	   (m_timeout_run >= m_failover_timeouts || m_all_lost) &&
+	   !failover(m_all_lost ? "all offline" : "timeouts", m_timeout_since))
+		m_timeout_run = 0;	// (no standby: count afresh)
+	m_all_lost = false;
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if(port2())
+		check_standby(now);
+
+	if(m_stats_interval > 0 && !m_monitor && now >= m_stats_report) {
+		if(m_stats_report.tv_sec != 0)
+			stats_report();
+		else
+			m_airtime_start = now;
+		m_stats_report = now;
+		m_stats_report.tv_sec += m_stats_interval;
+	}
+}
+
+void busprotocol::run() {
+	log4cpp::Category &root = log4cpp::Category::getRoot();
+
+	open_port();
+	started("");
+	for(;;) {
+		before_turn();
+		try {
+			if(!hotplug())
+				throw protocol_exception("device removed");
+			if(m_monitor)
+				monitor_frame();	// (I never transmit)
+			else
+				slave_poll();
+		}
+		catch(const protocol_exception &e) {
+			if(port_error(e)) {
+				close();
+				open_port();
+				root.error("port %s reopened", m_config.port);
+			}
+		}
+		after_turn();
+	} // end forever
+}
+
+task<void> busprotocol::co_open_port(busloop &loop) {
+	log4cpp::Category &root = log4cpp::Category::getRoot();
+
+	close_standby();
+	bool first = true;
+	while(!open_either()) {
+		if(first) {
+			root.error("Failed to open %s, waiting...", m_config.port);
+			first = false;
+		}
+		// As open_port(), but the loop carries on meanwhile
+		struct timespec until;
+		clock_gettime(CLOCK_MONOTONIC, &until);
+		until += 5000;
+		if(m_devwatch->fd() >= 0)
+			co_await loop.readable(m_devwatch->fd(), until);
+		else
+			co_await loop.until(until);
+		m_devwatch->wait(0);
+		m_devwatch->take(m_config.port);
+		m_devwatch->take(port2());
+	}
+	opened();
+}
+
+task<void> busprotocol::co_run(busloop &loop) {
+	log4cpp::Category &root = log4cpp::Category::getRoot();
+
+	co_await co_open_port(loop);
+	started(" (coroutines)");	// (the latency check blocks the loop, once)
+
+	size_t idle = 0;			// turns in a row nobody took
+	for(;;) {
+		polled_t polled = DIDNT_POLL;
+
+		before_turn();			// (discovery blocks it too: it's seldom,
+								// and asked for)
+
+		while(!m_file_jobs.empty()) {
+			file_job job = m_file_jobs.front();
+			m_file_jobs.pop();
+			uint8_t a = job.s->addr();
+			if(a >= 128 || m_transferring[a]) {
+				file_result r = { 0, 0, 0, "busy" };
+				struct timespec now;
+				clock_gettime(CLOCK_MONOTONIC, &now);
+				file_report(*job.s, job, r, now);
+				continue;
+			}
+			m_transferring[a] = true;
+			loop.spawn(co_file_job(loop, job));
+		}
+
+		// (No co_await in a handler: the port's reopened after it.)
+		bool reopen = false;
+		try {
+			if(!hotplug())
+				throw protocol_exception("device removed");
+			polled = co_await co_slave_poll(loop);
+		}
+		catch(const protocol_exception &e) {
+			reopen = port_error(e);
+		}
+		if(reopen) {
+			close();
+			co_await co_open_port(loop);
+			root.error("port %s reopened", m_config.port);
+		}
+
+		after_turn();
+
+		// A whole round with nobody's turn (all offline, and not yet
+		// due a probe, say): let the loop's other buses have a moment
+		if(polled == DID_POLL)
+			idle = 0;
+		else if(++idle >= m_slaves.size()) {
+			idle = 0;
+			co_await loop.after(1);
+		}
+	}
+}
+
+long busprotocol::probe_timeout(const osdpslave &s) const {
+	// A PD that discovery found slower than the probe timeout would
+	// never be heard: give it twice what it took then (though never
+	// more than the usual timeout).
+	long tmo = m_probe_timeout;
+	if(s.m_reply_us > 0 && 2 * s.m_reply_us > tmo)
+		tmo = 2 * s.m_reply_us;
+	return std::min(tmo, timeout());
+}
+
+bool busprotocol::probe_allowed(const struct timespec &now) {
+	// Refill the credit for the time gone by, up to one second's
+	// worth, so a quiet spell can't save up a long burst of probes.
+	if(m_probe_stamp.tv_sec != 0) {
+		struct timespec gone = now - m_probe_stamp;
+		double us = gone.tv_sec * 1e6 + gone.tv_nsec / 1e3;
+		m_probe_credit += us * m_probe_share;
+		double most = 1000000 * m_probe_share;
+		if(m_probe_credit > most)
+			m_probe_credit = most;
+	}
+	m_probe_stamp = now;
+	return m_probe_credit >= 0;
+}
+
+void busprotocol::probe_spent(osdpslave &s, const struct timespec &start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	struct timespec spent = now - start;
+	m_probe_credit -= spent.tv_sec * 1000000 + spent.tv_nsec / 1000;
+
+	if(!s.offline())
+		return;					// It answered!
+
+	// Still offline: back off exponentially, with up to 50% jitter
+	// so offline slaves don't fall into step with each other.
+	if(s.m_probe_ms == 0)
+		s.m_probe_ms = m_probe_interval;
+	else if((s.m_probe_ms *= 2) > m_probe_max)
+		s.m_probe_ms = m_probe_max;
+	long wait = s.m_probe_ms + random() % (s.m_probe_ms / 2 + 1);
+	s.m_next_assign = now;
+	s.m_next_assign += wait;
+}
+
+bool busprotocol::next_turn(turn_t &t) {
+	clock_gettime(CLOCK_MONOTONIC, &t.start);
+	const struct timespec &now = t.start;
+
+	// A reader that just read a card gets every other turn for a while
+	osdpslave *hot = NULL;
+	if(m_hot) {
+		if(now >= m_hot_until)
+			m_hot = NULL;		// its while is over
+		else if((m_hot_turn = !m_hot_turn))
+			hot = m_hot;
+	}
+
+	if(hot == NULL) {
+		auto a = m_poll_slave;
+		for(;;) {
+			a++;					 // Next
+			if(a == m_slaves.end()) // Past the end?
+				a = m_slaves.begin(); // roll back to start
+			if(a == m_poll_slave)
+				break;				// I went all the way 'round
+			if(a->defined() && a->addressed() && a->enabled())
+				break;				// Found the next defined slave
+		}
+		m_poll_slave = a;
+	}
+	osdpslave &s = hot ? *hot : *m_poll_slave;
+
+	if(!s.defined() || !s.addressed() || !s.enabled()) // None pollable.
+		return false;
+
+	if(hot == NULL)
+		s.visit(now);			// (its turn in the round)
+
+	t.s = &s;
+	t.probe = t.sendmsg = false;
+	t.timeout = timeout();
+	if(s.offline()) {
+		s.purge(); // clear out queued msgs (sorry dude)
+
+		// How to re-acquire a stopped slave: probe it with a poll,
+		// backing off further each time it doesn't answer.
+
+		// Is it time to try another poll?
+		if(now < s.m_next_assign)
+			return false;		// Not time to tickle.
+		if(!probe_allowed(now))
+			return false;		// Probes have had their share
+
+		// It needs a normal poll, with the (shorter) probe timeout
+		t.probe = true;
+		t.timeout = probe_timeout(s);
+		return true;
+	}
+
+	// Module thought online, but it missed a poll
+	if(s.m_retry > 0 && now < s.m_next_poll)
+		return false;
+
+	// send it real stuff
+	s.shed();				// (first, drop what's over its limits)
+	if(!s.empty()) {
+		t.msg = s.front();
+		t.sendmsg = true;
+	}
+	// (else nothing else to say, plain poll.)
+	return true;
+}
+
+busprotocol::polled_t busprotocol::turn_done(turn_t &t, int size) {
+	osdpslave &s = *t.s;
+	aircat_t kind = t.probe ? AIR_PROBE : s.m_retry > 0 ? AIR_RETRY : AIR_POLL;
+	exchanged(s, size, t.sendmsg, kind);
+	polled_t polled = slave_reply(s, size, t.sendmsg);
+	if(t.probe)
+		probe_spent(s, t.start);
+	return polled;
+}
+
+busprotocol::polled_t busprotocol::slave_poll(void) {
+	turn_t t;
+	if(!next_turn(t))
+		return DIDNT_POLL;
+	osdpslave &s = *t.s;
+
+	flush_input();
+	long saved_timeout = t.probe ? timeout(t.timeout) : 0;
+	int size;
+	try {
+		if(t.sendmsg) {
+			writecook(s.addr(), s.txseq(), t.msg.data);
+			clock_gettime(CLOCK_REALTIME, &s.m_wire);
+		}
+		else {
+			unsigned char pollmsg[1];
+			pollmsg[0] = OSDP_POLL;
+			writecook(s.addr(), s.txseq(), sizeof(pollmsg), pollmsg);
+		}
+		size = readcook();
+	}
+	catch(const protocol_exception &) {
+		if(t.probe)
+			timeout(saved_timeout);
+		throw;
+	}
+	if(t.probe)
+		timeout(saved_timeout);
+	return turn_done(t, size);
+}
+
+task<int> busprotocol::co_exchange(busloop &loop, int addr, int seq,
+									const blob *msg, long tmo,
+									struct timespec *wire) {
+	// writecook() and readcook(), but waiting on the loop
+	flush_input();
+	if(msg)
+		frame_out(addr, seq, *msg);
+	else {
+		unsigned char pollmsg[1];
+		pollmsg[0] = OSDP_POLL;
+		frame_out(addr, seq, sizeof(pollmsg), pollmsg); // (from the cache)
+	}
+	if(holdoff())
+		co_await loop.until(m_next_write);
+
+	struct iovec pieces[3], *left = pieces;
+	int count = m_out_iovcnt;
+	tx_begin(m_out_iov, count, pieces);
+	while(write_some(&left, &count))
+		co_await loop.writable(m_fd);
+	tx_done();
+	if(wire)
+		clock_gettime(CLOCK_REALTIME, wire);
+
+	long saved_timeout = timeout(tmo);
+	read_deadline();
+	timeout(saved_timeout);
+	int have = 0, size;
+	while((size = read_frame(have)) == 0) {
+		// (A hung-up port is always "readable", so look at the time)
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if(now >= m_deadline || !co_await loop.readable(m_fd, m_deadline)) {
+			size = PROTO_ERR_TIMEOUT;
+			break;
+		}
+	}
+	readstamp();				// Set m_next_write
+	co_return size;
+}
+
+task<busprotocol::polled_t> busprotocol::co_slave_poll(busloop &loop) {
+	turn_t t;
+	if(!next_turn(t))
+		co_return DIDNT_POLL;
+	osdpslave &s = *t.s;
+
+	if(m_turns[s.addr()]) {
+		co_await give_turn(s);	// A job's exchange, this time
+		co_return DID_POLL;
+	}
+
+	int size = co_await co_exchange(loop, s.addr(), s.txseq(),
+									t.sendmsg ? &t.msg.data : NULL,
+									t.timeout,
+									t.sendmsg ? &s.m_wire : NULL);
+	co_return turn_done(t, size);
+}
+
+busprotocol::polled_t busprotocol::slave_reply(osdpslave &s, int size,
+											   bool sendmsg) {
+	log4cpp::Category &root = log4cpp::Category::getRoot();
+	// prepare to work the reply
+	if(size > 0) { // I rx okay, work seq
+		m_timeout_run = 0;		// (the port's fine)
+		struct osdp_common_flex *omsg =
+			(struct osdp_common_flex *)m_in_buffer;
+		if((omsg->m.addr & 0x7F) != s.addr()) {
+			// Received from wrong address???
+			// Ignore.  Gah.
+			return DID_POLL;	// (but, I did poll.)
+		}
+		uint8_t seq = omsg->m.ctrl & 0x03;	// Get proto recvd sequence #
+		if(s.m_rxseq == 0 || seq == 0) {
+			s.m_rxseq = next_seq(seq);	// Determine next seq
+			// receipt okay, new sequence
+		}
+		else {
+			// OSDP document is not clear about the master's ("CP")
+			// behavior regarding the slave's ("PD") sequence numbers.
+			// If the CP does not hear a reply correctly, it asks again,
+			// with the same sequence number, which signals the PD to repeat
+			// the last message.  If the PD does not hear a poll correctly,
+			// the CP will poll it again (with the same seq).
+			// It does not explain behavior re the PD's receipt of CP
+			// sequence numbers.
+			// I'm going to behave as if they don't matter.
+		}
+		if(omsg->data[0] == OSDP_NAK ||
+			omsg->data[0] == OSDP_BUSY) {
+
+			if(omsg->data[0] == OSDP_NAK){
+				s.m_txseq = 0;
+			}
+
+			s.m_rxseq = next_seq(seq);
+
+			// A request the PD refused gets the NAK as its answer, and
+			// isn't sent again.  (Not after a sequence error: it's sent
+			// again, as it is when the PD is busy, and answered when
+			// it's taken.)
+			if(sendmsg && omsg->data[0] == OSDP_NAK && size-5 >= 2 &&
+			   omsg->data[1] != OSDP_NAK_SEQUENCE && s.front().correlated()) {
+				osdpmsg sent = s.front();
+				s.pop();
+				transport()->answer(s, sent, omsg->data, size-5);
+			}
+			return DID_POLL;		// not an ACK, but I polled
+		}
+
+		s.ack();		// I can xmit the next seq next time.
+		osdpmsg sent;
+		if(sendmsg) {
+			sent = s.front();	// (what this answers)
+			s.pop();			// No rexmit
+		}
+
+		// Card reads and keypresses take the fast lane first
+		uint8_t code = omsg->data[0];
+		if(code == OSDP_RAW || code == OSDP_FMT || code == OSDP_KEYPAD) {
+			if(code != OSDP_KEYPAD)
+				local_decision(s, omsg->data, size-5);
+			transport()->card(s, omsg->data, size-5);
+			if(m_hot_window > 0 && !s.offline()) {
+				m_hot = &s;
+				clock_gettime(CLOCK_MONOTONIC, &m_hot_until);
+				m_hot_until += m_hot_window;
+				m_hot_turn = false;
+			}
+		}
+
+		// Local clients get every reply (change_only is to spare the
+		// broker)
+		if(m_shm && code != OSDP_ACK)
+			m_shm->frame(s.addr(), omsg->data, size-5);
+
+		if(sent.correlated()) {
+			// A request: its reply goes back, ACK or not
+			transport()->answer(s, sent, omsg->data, size-5);
+			if(sent.reply_to.empty())
+				return DID_POLL; // (that was its usual publication)
+		}
+
+		// Handle received messages here
+		if(omsg->data[0] != OSDP_ACK) { // (not the mundane stuff)
+			// The messages start from the func byte.
+			// SOH addr LSM MSB flag func
+			// [0] [1]  [2] [3] [4]  [5]
+			if(s.changed(m_in_buffer + 5, size-5))
+				transport()->reply(s, m_in_buffer + 5, size-5);
+			// Off it goes (to the publisher thread).
+		}
+	}
+	else {
+		root.debug("** %d", size);
+		//root.info("readcook error %d", (int)size);
+		// (Offline or not: once they all are, only probes are left)
+		if(size == PROTO_ERR_TIMEOUT && m_timeout_run++ == 0)
+			m_timeout_since = tx_start(); // (a run of them, maybe)
+		bool was = s.offline();
+		s.nak();				// Sorry, didn't succeed
+		if(!was && s.offline() && all_offline())
+			m_all_lost = true;
+		// Handle errors, like timeout, for declaring modules STOPPED
+		if(size == PROTO_ERR_CRC)
+			katomic_inc(&m_crc_count);
+		else if(size == PROTO_ERR_TIMEOUT)
+			katomic_inc(&m_timeout_count);
+	}
+	return DID_POLL;
+}
+
+void busprotocol::local_decision(osdpslave &s, const uint8_t *reply, int len) {
+	if(m_creds == NULL || !s.decides())
+		return;
+	// The card data: RAW's bits, or FMT's characters
+	int skip = reply[0] == OSDP_RAW ? 5 : 4;
+	if(len <= skip)
+		return;
+	credential_t d = m_creds->lookup(reply + skip, len - skip);
+	if(d == CRED_UNKNOWN)
+		return;					// (the app's call)
+	s.decide(d == CRED_GRANT);
+	transport()->decided(s, reply + skip, len - skip, d == CRED_GRANT);
+}
+
+void busprotocol::monitor_frame(void) {
+	if(m_monitor_stats.empty()) {
+		// First time through: wake at least once a second to report
+		m_monitor_stats.resize(128);
+		timeout(1000000);
+		keep_long(true);		// (and publish what I can of big ones)
+		clock_gettime(CLOCK_MONOTONIC, &m_monitor_report);
+		m_monitor_report.tv_sec += m_monitor_interval;
+	}
+
+	int size = readcook();
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	if(size > 0) {
+		if(long_size())
+			m_monitor_long++;	// (published cut short)
+		const uint8_t *f = m_in_buffer;
+		uint8_t addr = f[1] & 0x7F;
+		bool reply = (f[1] & 0x80) != 0;
+		int off = 5;
+		if(f[4] & 0x08)
+			off += f[5];		// skip the security block
+		if(off < size) {
+			uint8_t code = f[off];
+			monitor_stats &st = m_monitor_stats[addr];
+			if(!reply) {
+				// A command.  If the last one went unanswered, that
+				// PD missed it.
+				if(m_monitor_pending >= 0)
+					m_monitor_stats[m_monitor_pending].missed++;
+				st.commands++;
+				m_monitor_pending = addr;
+				m_monitor_sent = now;
+			}
+			else {
+				st.replies++;
+				if(code == OSDP_NAK)
+					st.naks++;
+				else if(code == OSDP_BUSY)
+					st.busy++;
+				if(m_monitor_pending == addr) {
+					// Turnaround: from the end of the command to
+					// the start of this reply
+					struct timespec gap = now - m_monitor_sent;
+					long us = gap.tv_sec * 1000000 + gap.tv_nsec / 1000 -
+						wire_us(long_size() ? long_size() : size + 2);
+					if(st.latency_n == 0 || us < st.latency_min)
+						st.latency_min = us;
+					if(us > st.latency_max)
+						st.latency_max = us;
+					st.latency_total += us;
+					st.latency_n++;
+				}
+				m_monitor_pending = -1;
+			}
+
+			if(m_monitor_all || (code != OSDP_POLL && code != OSDP_ACK))
+				transport()->monitored(addr, reply, f + off, size - off);
+		}
+	}
+	else if(size == PROTO_ERR_CRC)
+		katomic_inc(&m_crc_count);
+
+	if(now >= m_monitor_report) {
+		monitor_report();
+		m_monitor_report = now;
+		m_monitor_report.tv_sec += m_monitor_interval;
+	}
+}
+
+void busprotocol::monitor_report(void) {
+	char text[256];
+	for(int a = 0; a < 128; a++) {
+		monitor_stats &st = m_monitor_stats[a];
+		if(st.commands == 0 && st.replies == 0)
+			continue;			// nobody home
+		int len = snprintf(text, sizeof(text),
+						   "{\"commands\":%lu,\"replies\":%lu,\"naks\":%lu,"
+						   "\"busy\":%lu,\"missed\":%lu,"
+						   "\"turnaround_min_us\":%ld,\"turnaround_avg_us\":%ld,"
+						   "\"turnaround_max_us\":%ld}",
+						   st.commands, st.replies, st.naks, st.busy, st.missed,
+						   st.latency_min,
+						   st.latency_n ? st.latency_total / (long)st.latency_n : 0L,
+						   st.latency_max);
+		transport()->report("monitor", a, text, len);
+		memset(&st, 0, sizeof(st)); // next interval starts fresh
+	}
+	int len = snprintf(text, sizeof(text),
+					   "{\"crc_errors\":%d,\"overflows\":%lu}",
+					   (int)m_crc_count, m_monitor_long);
+	transport()->report("monitor", -1, text, len);
+}
+
+// Is there room in s's queue for this message?  If not, it's dealt
+// with by the policy of whichever limit it's over.
+static bool admitted(osdpslave &s, int len, long mid) {
+	log4cpp::Category &root = log4cpp::Category::getRoot();
+	const char *why = NULL;
+	switch(s.admit(len, &why)) {
+	case QUEUE_ADMIT:
+		return true;
+	case QUEUE_DROP_OLDEST:
+		if(strncmp(why, "bus", 3) == 0)
+			katomic_inc(&s.m_shed); // (over its own limits, it sheds
+									// enough by itself)
+		return true;
+	case QUEUE_DROP_NEWEST:
+		root.info("Queue for %d full (%s); msg %ld dropped",
+				  (int)s.addr(), why, mid);
+		s.dropped();
+		return false;
+	case QUEUE_REJECT:
+		break;
+	}
+	root.warn("Queue for %d full (%s); msg %ld rejected",
+			  (int)s.addr(), why, mid);
+	s.rejected();
+	s.bus()->transport()->rejected(s, why, mid);
+	return false;
+}
+
+// Queue a command for a slave, journaling it first if it's durable
+static void enqueue(osdpslave &s, osdpmsg &msg, bool durable, int cls, long mid) {
+	log4cpp::Category &root = log4cpp::Category::getRoot();
+	journal *j = s.bus()->journal();
+	if(durable && j == NULL)
+		root.warn("No journal; msg %ld to %d isn't durable",
+				  mid, (int)s.addr());
+	else if(durable) {
+		// Durable: into the journal first, so it outlives me
+		msg.journal = j->append(s.addr(), s.uuid(), msg.data.pvoid(),
+								msg.data.size());
+		if(!msg.durable())
+			root.error("Journal full; msg %ld to %d isn't durable",
+					   mid, (int)s.addr());
+	}
+	if(cls < 0)
+		s.push(msg);			// (class by command code)
+	else
+		s.push(msg, (msgclass_t)cls);
+}
+
+
+bool busprotocol::submit(osdpslave &s, osdpmsg &msg, bool durable, int cls,
+						 long mid) {
+	log4cpp::Category &root = log4cpp::Category::getRoot();
+	if(!s.enabled()) {
+		root.info("Message for disabled slave %d ignored", (int)s.addr());
+		return false;
+	}
+	if(cls >= MSG_CLASSES || msg.data.size() == 0) {
+		root.warn("Malformed msg %ld to %d ignored", mid, (int)s.addr());
+		return false;
+	}
+	if(!admitted(s, msg.data.size(), mid))
+		return false;
+	enqueue(s, msg, durable, cls, mid);
+	return true;
+}
+
+void busprotocol::shm_commands(void) {
+	log4cpp::Category &root = log4cpp::Category::getRoot();
+	struct osdpshm_command *c;
+	while((c = m_shm->command()) != NULL) {
+		long mid = (long)(c->seq - 1); // (its place in the ring)
+		osdpslave *s;
+		if(c->addr == OSDPSHM_BY_UUID)
+			s = find_slave(c->uuid);
+		else
+			s = find_slave(c->addr);
+		if(s == NULL)
+			root.info("No slave %d for shm msg %ld", (int)c->addr, mid);
+		else if(c->len > OSDPSHM_COMMAND_DATA)
+			root.warn("Malformed shm msg %ld ignored", mid);
+		else {
+			osdpmsg msg(blob(c->data, c->len));
+			submit(*s, msg, (c->flags & OSDPSHM_DURABLE) != 0, c->cls, mid);
+		}
+		m_shm->done();
+	}
+}
+
+std::coroutine_handle<> busprotocol::turn_await::await_suspend(std::coroutine_handle<> h) {
+	std::coroutine_handle<> next;
+	if(give) {
+		// The bus: the job goes, and comes back to me
+		bus.m_turn_back = h;
+		bus.m_turn_holder = &s;
+		next = std::exchange(bus.m_turns[s.addr()], nullptr);
+	}
+	else {
+		// A job: wait for s's turn, and if I had the bus, let it
+		// carry on
+		bus.m_turns[s.addr()] = h;
+		if(bus.m_turn_holder == &s) {
+			bus.m_turn_holder = NULL;
+			next = std::exchange(bus.m_turn_back, nullptr);
+		}
+	}
+	return next ? next : std::noop_coroutine();
+}
+
+void busprotocol::turn_await::await_resume() {
+	// (An I/O error in the job's exchange is the bus's to handle)
+	if(give && bus.m_turn_error)
+		std::rethrow_exception(std::exchange(bus.m_turn_error, nullptr));
+}
+
+void busprotocol::end_turn(busloop &loop, osdpslave &s) {
+	if(m_turn_holder == &s) {
+		m_turn_holder = NULL;
+		loop.post(std::exchange(m_turn_back, nullptr));
+	}
+}
+
+bool busprotocol::transfer_file(osdpslave &s, const blob &file, int type) {
+	if(!m_coroutines || file.size() == 0)
+		return false;
+	file_job job = { &s, file, type };
+	m_file_jobs.push(job);
+	return true;
+}
+
+static void put_le(uint8_t *p, unsigned long v, int bytes) {
+	for(int i = 0; i < bytes; i++, v >>= 8)
+		p[i] = v & 0xFF;
+}
+
+task<void> busprotocol::file_transfer(busloop &loop, osdpslave &s,
+									  const file_job &job, file_result &r) {
+	const uint8_t *file = (const uint8_t *)job.file.pvoid();
+	long total = job.file.size();
+	long most = m_file_fragment; // (the PD may ask for less)
+	long offset = 0;
+	bool finishing = false;		// (it has it all, and is busy with it)
+	for(;;) {
+		co_await my_turn(s);
+		if(s.offline() || !s.enabled()) {
+			r.result = "offline";
+			co_return;
+		}
+
+		// FtType, FtSizeTotal, FtOffset, FtFragmentSize, then the
+		// fragment (none, while it's finishing)
+		long frag = finishing ? 0 : total - offset;
+		if(frag > most)
+			frag = most;
+		std::vector<uint8_t> m(12 + frag);
+		m[0] = OSDP_FILETRANSFER;
+		m[1] = job.type;
+		put_le(m.data() + 2, total, 4);
+		put_le(m.data() + 6, offset, 4);
+		put_le(m.data() + 10, frag, 2);
+		memcpy(m.data() + 12, file + offset, frag);
+		blob msg(m);
+
+		int size = co_await co_exchange(loop, s.addr(), s.txseq(), &msg,
+										timeout());
+		exchanged(s, size, true, AIR_POLL);
+		uint8_t code = 0;
+		if(size > 5 && (m_in_buffer[1] & 0x7F) == s.addr())
+			code = m_in_buffer[5];
+		slave_reply(s, size, false);
+		if(code == 0 || code == OSDP_BUSY)
+			continue;			// The same again, next turn
+		if(code == OSDP_NAK) {
+			r.result = "refused";
+			co_return;
+		}
+
+		r.fragments++;
+		offset += frag;
+		r.sent = offset;
+		long delay = 0;
+		if(code == OSDP_FTSTAT && size >= 5 + 8) {
+			// FtAction, FtDelay, FtStatusDetail, FtUpdateMsgMax
+			const uint8_t *st = m_in_buffer + 5;
+			delay = st[2] | (st[3] << 8);
+			r.detail = (int16_t)(st[4] | (st[5] << 8));
+			long max = st[6] | (st[7] << 8);
+			if(max > 19 + 1 && max - 19 < most)
+				most = max - 19; // (that's the whole frame: 19 is the
+								 // rest of it, header to CRC)
+			if(r.detail < 0) {
+				r.result = "aborted";
+				co_return;
+			}
+			if(r.detail == 1 || r.detail == 2) {
+				r.result = "done"; // (2: and it's rebooting)
+				co_return;
+			}
+			finishing = r.detail == 3;
+		}
+		if(!finishing && offset >= total) {
+			r.result = "done";
+			co_return;
+		}
+
+		// It asked for a moment: meanwhile, it's polled as usual
+		if(delay > 0) {
+			end_turn(loop, s);
+			co_await loop.after(delay);
+		}
+	}
+}
+
+task<void> busprotocol::co_file_job(busloop &loop, file_job job) {
+	uint8_t a = job.s->addr();
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	file_result r = { 0, 0, 0, "error" };
+	try {
+		co_await file_transfer(loop, *job.s, job, r);
+	}
+	catch(const protocol_exception &e) {
+		if(m_turn_holder == job.s) // (it was in my exchange)
+			m_turn_error = std::current_exception();
+	}
+	m_transferring[a] = false;
+	file_report(*job.s, job, r, start);
+	end_turn(loop, *job.s);
+}
+
+void busprotocol::file_report(osdpslave &s, const file_job &job,
+							  const file_result &r,
+							  const struct timespec &start) {
+	log4cpp::Category &root = log4cpp::Category::getRoot();
+	struct timespec elapsed;
+	clock_gettime(CLOCK_MONOTONIC, &elapsed);
+	elapsed -= start;
+	char text[256];
+	int len = snprintf(text, sizeof(text),
+					   "{\"type\":%d,\"size\":%zu,\"sent\":%ld,"
+					   "\"fragments\":%d,\"detail\":%d,\"result\":\"%s\","
+					   "\"elapsed_ms\":%ld}",
+					   job.type, (size_t)job.file.size(), r.sent,
+					   r.fragments, r.detail, r.result, to_ms(elapsed));
+	root.info("File transfer to %d %s", (int)s.addr(), text);
+	transport()->report(s, "file", text, len);
+}
@@ -0,0 +1,378 @@
+#ifndef BUSPROTOCOL_H
+#define BUSPROTOCOL_H
+
+// The bus engine: polls the slaves on a bus, queues their commands,
+// and tells a transport (see transport.h) what they say.  It's the
+// heart of libosdpmaster; osdpmaster itself is an MQTT transport
+// around it.
+
+#include <coroutine>
+#include <exception>
+#include <list>
+#include <unordered_map>
+#include <vector>
+#include "log4cpp.h"
+
+#include "osdpprotocol.h"
+#include "osdpslave.h"
+#include "transport.h"
+#include "journal.h"
+#include "credcache.h"
+#include "shmtransport.h"
+#include "devwatch.h"
+#include "busloop.h"
+#include "sync_queue.h"
+
+class logprotocol: public protocol {
+public:
+	logprotocol(struct serial_config *config)
+		: protocol(config) {
+	}
+
+	virtual ~logprotocol() {
+	}
+
+protected:
+	static void datalog(const char *prefix, const uint8_t *buffer, int len);
+
+	virtual void xlog(const uint8_t *buffer, int len) {
+		datalog("TX", buffer, len);
+	}
+
+	virtual void rlog(const uint8_t *buffer, int len) {
+		datalog("RX", buffer, len);
+	}
+
+};
+
+class busprotocol: public logprotocol {
+public:
+	typedef std::list<osdpslave> slavelist_t;
+	slavelist_t m_slaves; 	// here I instantiate the slaves I address
+	slavelist_t::iterator m_poll_slave;
+
+	// Ingress routing: incoming MQTT commands find their slave
+	// through these, rather than by walking m_slaves.  (Slaves
+	// re-index themselves when their address or UUID changes, on
+	// whatever thread changed it, while the MQTT thread looks things
+	// up: both go under m_index_lock.)
+	osdpslave *m_by_addr[128];	// indexed by OSDP address
+	typedef std::unordered_map<uuid_key, osdpslave *, uuid_key_hash> uuidindex_t;
+	uuidindex_t m_by_uuid;		// indexed by factory UUID
+	boost::mutex m_index_lock;
+
+	int m_busno;				// I'm "bus<n>" (in logs, and to whoever made me)
+
+	// The queue for BUS messages
+	blobqueue_t m_msglist;
+
+	katomic_t m_crc_count;
+	katomic_t m_timeout_count;
+
+	class transport *m_transport; // where what happens is told
+
+	class journal *m_journal;	// durable commands, or NULL if none
+	credcache *m_creds;			// local card decisions, or NULL if none
+	shmtransport *m_shm;		// local clients' rings, or NULL if none
+
+	// Backpressure for all my slaves' queues together (0 means no
+	// limit).  Over them, m_policy applies to the slave at hand.
+	katomic_t m_queued;			// messages queued
+	katomic_t m_queued_bytes;
+	size_t m_max_msgs;
+	size_t m_max_bytes;
+	qpolicy_t m_policy;
+	int m_stats_interval;		// seconds between stats reports
+	struct timespec m_stats_report; // when to report next
+
+	// Airtime: MICROseconds of bus time spent on each category since
+	// m_airtime_start (my slaves each have their share, too)
+	long m_airtime[AIR_CATEGORIES];
+	struct timespec m_airtime_start;
+
+	// Card reads: for a while after one, the reader that read it gets
+	// every other poll, so the follow-up LED/BUZ goes out sooner.
+	osdpslave *m_hot;			// that reader, or NULL
+	struct timespec m_hot_until;
+	bool m_hot_turn;			// its turn next?
+	long m_hot_window;			// how long, milliseconds (0 = never)
+
+	// Failing over to the standby port (port2): on an I/O error, or
+	// after m_failover_timeouts timeouts in a row (probes too), or as
+	// the last online slave goes offline (probes come too seldom to
+	// count on)
+	int m_failover_timeouts;	// (0 = only on I/O errors)
+	int m_timeout_run;			// timeouts in a row so far
+	struct timespec m_timeout_since; // ...since the first of them
+	bool m_all_lost;			// the last one just went offline
+	long m_failovers;
+	long m_standby_check;		// how often to check on it, milliseconds
+	struct timespec m_standby_next;	// when next
+	bool m_standby_up;			// (last I checked)
+
+	devwatch *m_devwatch;		// hears the ports' device nodes come and go
+
+	// The coroutine engine (port.engine = coroutines): co_run() on a
+	// busloop, instead of run() on a thread of my own
+	bool m_coroutines;
+
+	// File transfers: each is a coroutine of its own (co_file_job),
+	// which takes its slave's turns on the bus, one fragment a turn,
+	// until it's done.
+	struct file_job {
+		osdpslave *s;
+		blob file;
+		int type;				// FtType
+	};
+	sync_queue<file_job> m_file_jobs; // (from other threads)
+	std::coroutine_handle<> m_turns[128]; // (by address) a job waiting for
+										  // its slave's next turn
+	bool m_transferring[128];
+	std::coroutine_handle<> m_turn_back; // the bus, while a job has a turn
+	osdpslave *m_turn_holder;	// (whose job that is: only it gives it back)
+	std::exception_ptr m_turn_error; // (and how the job's turn ended)
+	int m_file_fragment;		// bytes of file per FILETRANSFER, at most
+
+	// Discovery: what answered OSDP_ID at each address in the last
+	// sweep, and how quickly.
+	struct discovered_t {
+		bool found;
+		uuid_t uuid;			// (derived from its PDID)
+		long reply_us;
+	} m_discovered[128];
+	katomic_t m_discover;		// non-zero: sweep before the next poll
+	long m_discover_timeout;	// reply timeout during sweeps, MICROseconds
+
+	int m_latency_check;		// (USB) ID exchanges to time, untuned
+								// and tuned, at startup (0: don't)
+
+	// Probing offline slaves: each probe costs its bus time out of
+	// m_probe_credit, which refills at m_probe_share of real time.
+	double m_probe_share;		// fraction of bus time for probes
+	long m_probe_timeout;		// reply timeout for probes, MICROseconds
+	long m_probe_interval;		// first backoff, milliseconds
+	long m_probe_max;			// longest backoff, milliseconds
+	double m_probe_credit;		// MICROseconds of probing allowed now
+	struct timespec m_probe_stamp; // when m_probe_credit was figured
+
+	// Monitor mode: never transmit, just listen to someone else's
+	// bus and report what's said, and how promptly PDs answer.
+	bool m_monitor;
+	bool m_monitor_all;			// include POLLs and ACKs in the traffic
+	int m_monitor_interval;		// seconds between stats reports
+	struct monitor_stats {
+		unsigned long commands, replies, naks, busy, missed;
+		unsigned long latency_n;
+		long latency_total, latency_min, latency_max; // MICROseconds
+	};
+	std::vector<monitor_stats> m_monitor_stats; // by address
+	int m_monitor_pending;		// address awaiting a reply, or -1
+	struct timespec m_monitor_sent;	// when that command finished
+	struct timespec m_monitor_report; // when to report next
+	unsigned long m_monitor_long; // frames too long to keep whole
+
+public:
+	busprotocol(struct serial_config *config)
+		: logprotocol(config),
+		m_crc_count(0), m_timeout_count(0) {
+		m_poll_slave = m_slaves.end();
+		m_failover_timeouts = 0;
+		m_timeout_run = 0;
+		memset(&m_timeout_since, 0, sizeof(m_timeout_since));
+		m_all_lost = false;
+		m_failovers = 0;
+		m_standby_check = 1000;
+		memset(&m_standby_next, 0, sizeof(m_standby_next));
+		m_standby_up = false;
+		m_devwatch = NULL;
+		m_coroutines = false;
+		memset(m_transferring, 0, sizeof(m_transferring));
+		m_turn_holder = NULL;
+		m_file_fragment = 128;
+		m_transport = NULL;
+		m_journal = NULL;
+		m_creds = NULL;
+		m_shm = NULL;
+		m_queued = 0;
+		m_queued_bytes = 0;
+		m_max_msgs = 0;
+		m_max_bytes = 0;
+		m_policy = QUEUE_REJECT;
+		m_stats_interval = 0;
+		memset(&m_stats_report, 0, sizeof(m_stats_report));
+		memset(m_airtime, 0, sizeof(m_airtime));
+		memset(&m_airtime_start, 0, sizeof(m_airtime_start));
+		m_hot = NULL;
+		memset(&m_hot_until, 0, sizeof(m_hot_until));
+		m_hot_turn = false;
+		m_hot_window = 250;
+		memset(m_by_addr, 0, sizeof(m_by_addr));
+		m_busno = 1;
+		memset(m_discovered, 0, sizeof(m_discovered));
+		m_discover = 0;
+		m_discover_timeout = 20000;
+		m_latency_check = 0;
+		m_probe_share = 0.1;
+		m_probe_timeout = 20000;
+		m_probe_interval = 5000;
+		m_probe_max = 60000;
+		m_probe_credit = 0;
+		memset(&m_probe_stamp, 0, sizeof(m_probe_stamp));
+		m_monitor = false;
+		m_monitor_all = false;
+		m_monitor_interval = 10;
+		m_monitor_pending = -1;
+		m_monitor_long = 0;
+	}
+
+	virtual ~busprotocol() {
+		delete m_devwatch;
+	}
+
+	osdpslave &add_slave(const char *addr);
+
+	void index_slave(osdpslave &s);	// enter s into the routing indexes
+	void unindex_slave(osdpslave &s); // take s out of them
+
+	osdpslave *find_slave(uint8_t addr);
+	osdpslave *find_slave(const uuid_t uuid);
+
+	inline int busno(void) const { return m_busno; }
+
+	inline bool empty() {
+		return m_msglist.empty();
+	}
+	inline blob front() {
+		return m_msglist.front();
+	}
+	inline void pop() {
+		m_msglist.pop();
+	}
+
+	inline void push(blob msg) {
+		m_msglist.push(msg);
+	}
+
+	void init();
+	void run();
+
+	// The same, as a coroutine (see busloop.h): it never blocks, but
+	// for discovery and the latency check
+	task<void> co_run(busloop &loop);
+	task<void> co_open_port(busloop &loop);
+	task<int> co_exchange(busloop &loop, int addr, int seq, const blob *msg,
+						  long tmo, struct timespec *wire = NULL);
+
+	typedef enum {
+		DID_POLL, DIDNT_POLL
+	} polled_t;
+	polled_t slave_poll(void);
+	polled_t slave_reply(osdpslave &s, int size, bool sendmsg);
+
+	// A slave's turn on the bus, as slave_poll() takes it: who, and
+	// what it gets (shared with the coroutine engine, co_slave_poll)
+	struct turn_t {
+		osdpslave *s;
+		bool probe;				// (it's offline) a poll, probe timeout
+		long timeout;			// its reply timeout, MICROseconds
+		bool sendmsg;			// msg, else a poll
+		osdpmsg msg;
+		struct timespec start;
+	};
+	bool next_turn(turn_t &t);	// false: nobody's turn, this time
+	polled_t turn_done(turn_t &t, int size); // account for it, & the reply
+	task<polled_t> co_slave_poll(busloop &loop);
+
+	// Jobs (file transfers) and the bus take turns: a job co_awaits
+	// my_turn(s), and the bus, when it's s's turn, give_turn(s); the
+	// job's exchange done, it co_awaits my_turn() again, or end_turn()s
+	// to go and wait for something else.  Either way, only the job
+	// that was given the turn hands the bus back: any other is only
+	// waiting for its own.
+	struct turn_await {
+		busprotocol &bus;
+		osdpslave &s;
+		bool give;				// (the bus's side)
+		bool await_ready() const noexcept { return false; }
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<> h);
+		void await_resume();
+	};
+	inline turn_await my_turn(osdpslave &s) { return turn_await{*this, s, false}; }
+	inline turn_await give_turn(osdpslave &s) { return turn_await{*this, s, true}; }
+	void end_turn(busloop &loop, osdpslave &s);
+
+	// Send s a file (OSDP_FILETRANSFER), with the coroutine engine;
+	// false if it's not running.  How it went is reported as "file".
+	bool transfer_file(osdpslave &s, const blob &file, int type);
+	struct file_result {
+		long sent;				// bytes of it the PD took
+		int fragments;
+		int detail;				// its last FtStatusDetail
+		const char *result;
+	};
+	task<void> file_transfer(busloop &loop, osdpslave &s, const file_job &job,
+							 file_result &r);
+	task<void> co_file_job(busloop &loop, file_job job);
+	void file_report(osdpslave &s, const file_job &job, const file_result &r,
+					 const struct timespec &start);
+
+	long probe_timeout(const osdpslave &s) const;
+	bool probe_allowed(const struct timespec &now);
+	void probe_spent(osdpslave &s, const struct timespec &start);
+
+	bool id_slave(const uuid_t uuid);
+
+	void discover(void);		// sweep the bus for PDs
+	int probe_id(uint8_t addr, uint8_t seq, long *reply_us);
+	void discovered(uint8_t addr, long reply_us);
+	inline void request_discover(void) { m_discover = 1; }
+
+	void port_report(void);		// (USB) how the port's tuned
+	void latency_check(void);	// ...and what difference it makes
+
+	void monitor_frame(void);	// (monitor mode) hear & report one frame
+	void monitor_report(void);
+	inline bool monitoring(void) const { return m_monitor; }
+
+	inline class transport *transport(void) { return m_transport; }
+	inline class journal *journal(void) { return m_journal; }
+	inline credcache *creds(void) { return m_creds; }
+	// A card read: if the credential cache knows the card, answer it
+	// here and now.
+	void local_decision(osdpslave &s, const uint8_t *reply, int len);
+	void shm_commands(void);	// queue what local clients sent
+
+	// Queue a command for s, from whatever source ("mid" names it in
+	// logs and rejections).  Returns false if it's refused: s is
+	// disabled, or over its limits, or the command's malformed.
+	bool submit(osdpslave &s, osdpmsg &msg, bool durable, int cls, long mid);
+
+	qpolicy_t admit(size_t bytes, const char **why);
+	inline void queued(int msgs, long bytes) {
+		katomic_add(&m_queued, msgs);
+		katomic_add(&m_queued_bytes, bytes);
+	}
+	void stats_report(void);	// publish queue stats & airtime
+
+	// Account for the bus time of the exchange that just finished
+	void exchanged(osdpslave &s, int size, bool sendmsg, aircat_t kind);
+
+	void open_port(void);		// keep at it until the port's open
+	bool open_either(void);		// (its tries, port then port2)
+	void opened(void);			// (and then, the standby)
+	bool hotplug(void);			// (news of the ports' devices) false if
+								// the active one's gone
+	bool failover(const char *why, const struct timespec &since);
+	bool all_offline(void) const; // (every slave I poll)
+	void check_standby(const struct timespec &now);
+
+	// What run() and co_run() both do between turns on the bus
+	void started(const char *engine); // (the port's first opened)
+	void before_turn(void);		// discovery, if asked; local clients
+	bool port_error(const protocol_exception &e); // true: reopen it
+	void after_turn(void);		// failover on timeouts, standby, stats
+};
+
+void *busprotocol_run(void *param); // (thread main)
+
+#endif // BUSPROTOCOL_H
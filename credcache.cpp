@@ -0,0 +1,199 @@
+#include <cctype>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "log4cpp.h"
+
+#include "credcache.h"
+
+credcache::credcache(size_t capacity) {
+	size_t slots = 16;
+	while(slots < capacity)
+		slots <<= 1;
+	m_table = new table;
+	m_table->slots = new slot[slots];
+	memset(m_table->slots, 0, slots * sizeof(slot));
+	m_table->mask = slots - 1;
+	m_table->count = m_table->gone = 0;
+	pthread_mutex_init(&m_lock, NULL);
+}
+
+credcache::~credcache() {
+	delete[] m_table->slots;
+	delete m_table;
+}
+
+uint32_t credcache::hash(const uint8_t *key, int len) {
+	// FNV-1a
+	uint32_t h = 2166136261u;
+	for(int i = 0; i < len; i++) {
+		h ^= key[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+credcache::slot *credcache::find(table &t, const uint8_t *key, int len) {
+	for(size_t i = hash(key, len) & t.mask;; i = (i + 1) & t.mask) {
+		slot &s = t.slots[i];
+		if(s.state == SLOT_EMPTY)
+			return NULL;
+		if(s.state == SLOT_USED && s.len == len && memcmp(s.key, key, len) == 0)
+			return &s;
+	}
+}
+
+void credcache::rehash(table &t) {
+	std::vector<slot> used;
+	for(size_t i = 0; i <= t.mask; i++)
+		if(t.slots[i].state == SLOT_USED)
+			used.push_back(t.slots[i]);
+	memset(t.slots, 0, (t.mask + 1) * sizeof(slot));
+	for(auto u = used.begin(); u != used.end(); u++) {
+		size_t i = hash(u->key, u->len) & t.mask;
+		while(t.slots[i].state != SLOT_EMPTY)
+			i = (i + 1) & t.mask;
+		t.slots[i] = *u;
+	}
+	t.gone = 0;
+}
+
+bool credcache::set(table &t, const uint8_t *key, int len,
+					credential_t decision) {
+	slot *s = find(t, key, len);
+	if(s) {
+		s->decision = decision;
+		return true;
+	}
+
+	// Keep it at most 3/4 full, so probes stay short (and end)
+	size_t limit = (t.mask + 1) / 4 * 3;
+	if(t.count + t.gone >= limit && t.gone > 0)
+		rehash(t);
+	if(t.count >= limit)
+		return false;
+
+	size_t i = hash(key, len) & t.mask;
+	while(t.slots[i].state == SLOT_USED)
+		i = (i + 1) & t.mask;
+	if(t.slots[i].state == SLOT_GONE)
+		t.gone--;
+	s = &t.slots[i];
+	s->decision = decision;
+	s->len = len;
+	memcpy(s->key, key, len);
+	s->state = SLOT_USED;
+	t.count++;
+	return true;
+}
+
+bool credcache::remove(table &t, const uint8_t *key, int len) {
+	slot *s = find(t, key, len);
+	if(s == NULL)
+		return false;
+	s->state = SLOT_GONE;
+	t.count--;
+	t.gone++;
+	return true;
+}
+
+credential_t credcache::lookup(const uint8_t *key, int len) {
+	if(len <= 0 || len > CREDCACHE_KEY_MAX)
+		return CRED_UNKNOWN;
+	pthread_mutex_lock(&m_lock);
+	slot *s = find(*m_table, key, len);
+	credential_t d = s ? (credential_t)s->decision : CRED_UNKNOWN;
+	pthread_mutex_unlock(&m_lock);
+	return d;
+}
+
+// Hex digits to bytes; returns how many, or -1 if it isn't all hex
+// (or too long for a key)
+static int parse_hex(const char *p, const char *end, uint8_t *key) {
+	int len = 0;
+	while(p < end && isspace((unsigned char)*p))
+		p++;
+	while(end > p && isspace((unsigned char)end[-1]))
+		end--;
+	if((end - p) % 2 != 0 || (end - p) / 2 > CREDCACHE_KEY_MAX)
+		return -1;
+	for(; p < end; p += 2) {
+		if(!isxdigit((unsigned char)p[0]) || !isxdigit((unsigned char)p[1]))
+			return -1;
+		char byte[3] = { p[0], p[1], '\0' };
+		key[len++] = strtoul(byte, NULL, 16);
+	}
+	return len;
+}
+
+int credcache::update(const char *text, int len) {
+	log4cpp::Category &root = log4cpp::Category::getRoot();
+	static const struct {
+		const char *word;
+		int decision;			// (-1 for REMOVE)
+	} verbs[] = {
+		{ "GRANT", CRED_GRANT }, { "DENY", CRED_DENY }, { "REMOVE", -1 },
+	};
+	int applied = 0;
+	const char *end = text + len;
+
+	// A copy to work on.  (I'm the only one who changes the table, so
+	// I can read it without the lock.)
+	table *t = new table(*m_table);
+	size_t bytes = (t->mask + 1) * sizeof(slot);
+	t->slots = new slot[t->mask + 1];
+	memcpy(t->slots, m_table->slots, bytes);
+
+	for(const char *line = text; line < end;) {
+		const char *eol = (const char *)memchr(line, '\n', end - line);
+		if(eol == NULL)
+			eol = end;
+		const char *p = line;
+		line = eol + 1;
+
+		while(p < eol && isspace((unsigned char)*p))
+			p++;
+		if(p == eol)
+			continue;			// (blank)
+		const char *word = p;
+		while(p < eol && !isspace((unsigned char)*p))
+			p++;
+		std::string verb(word, p - word);
+
+		if(verb == "CLEAR") {
+			memset(t->slots, 0, bytes);
+			t->count = t->gone = 0;
+			applied++;
+			continue;
+		}
+
+		size_t v;
+		for(v = 0; v < sizeof(verbs)/sizeof(verbs[0]); v++)
+			if(verb == verbs[v].word)
+				break;
+		uint8_t key[CREDCACHE_KEY_MAX];
+		int klen = parse_hex(p, eol, key);
+		if(v == sizeof(verbs)/sizeof(verbs[0]) || klen <= 0) {
+			root.warn("credentials: can't make out \"%.*s\"",
+					  (int)(eol - word), word);
+			continue;
+		}
+		if(verbs[v].decision < 0)
+			remove(*t, key, klen); // (gone already is fine)
+		else if(!set(*t, key, klen, (credential_t)verbs[v].decision)) {
+			root.error("credentials: table full (%zu); \"%.*s\" ignored",
+					   t->count, (int)(eol - word), word);
+			continue;
+		}
+		applied++;
+	}
+
+	pthread_mutex_lock(&m_lock);
+	std::swap(m_table, t);
+	pthread_mutex_unlock(&m_lock);
+	delete[] t->slots;			// (the old one)
+	delete t;
+	return applied;
+}
@@ -0,0 +1,68 @@
+#ifndef CREDCACHE_H
+#define CREDCACHE_H
+
+// Credentials the master may decide on itself.  When a reader reads a
+// card that's in here, the reader's configured grant (or deny)
+// commands are queued for it right away, instead of waiting for an
+// app to hear of the read over MQTT and answer.  The table is an
+// open-addressing hash (linear probing) keyed by the card data, loaded
+// and updated over MQTT; cards not in it are left to the app, as ever.
+
+#include <pthread.h>
+
+#include <cstddef>
+#include <cstdint>
+
+#define CREDCACHE_KEY_MAX 32	// bytes of card data, at most
+
+typedef enum {
+	CRED_UNKNOWN,				// not in the table: the app decides
+	CRED_GRANT,
+	CRED_DENY
+} credential_t;
+
+class credcache {
+protected:
+	enum { SLOT_EMPTY, SLOT_USED, SLOT_GONE };
+
+	struct slot {
+		uint8_t state;
+		uint8_t decision;		// (a credential_t)
+		uint8_t len;
+		uint8_t key[CREDCACHE_KEY_MAX];
+	};
+
+	struct table {
+		slot *slots;
+		size_t mask;			// (slots - 1; slots are a power of 2)
+		size_t count;			// slots in use
+		size_t gone;			// slots removed from (still probed past)
+	};
+
+	// The MQTT thread updates a copy and swaps it in, so the bus
+	// thread's lookups only ever wait for the swap
+	table *m_table;
+	pthread_mutex_t m_lock;		// (for m_table itself)
+
+	static uint32_t hash(const uint8_t *key, int len);
+	static slot *find(table &t, const uint8_t *key, int len); // or NULL
+	static void rehash(table &t); // sweep out the removed slots
+	static bool set(table &t, const uint8_t *key, int len,
+					credential_t decision);
+	static bool remove(table &t, const uint8_t *key, int len);
+
+public:
+	credcache(size_t capacity);	// (rounded up to a power of 2)
+	~credcache();
+
+	credential_t lookup(const uint8_t *key, int len);
+
+	// Apply an update: lines of "GRANT <hex>", "DENY <hex>",
+	// "REMOVE <hex>" or "CLEAR".  Returns how many lines it applied;
+	// the rest are logged.
+	int update(const char *text, int len);
+
+	inline size_t size(void) const { return m_table->count; } // (updater's)
+};
+
+#endif // CREDCACHE_H
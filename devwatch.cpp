@@ -0,0 +1,130 @@
+#include <sys/inotify.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+
+#include "log4cpp.h"
+
+#include "devwatch.h"
+
+devwatch::devwatch() {
+	m_fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+	if(m_fd < 0) {
+		log4cpp::Category &root = log4cpp::Category::getRoot();
+		root.warn("No inotify (%s); ports will be retried every so often",
+				  strerror(errno));
+	}
+}
+
+devwatch::~devwatch() {
+	if(m_fd >= 0)
+		close(m_fd);
+}
+
+// "/dev/ttyUSB0" to "/dev" and "ttyUSB0"
+static void split_path(const char *path, std::string &dir, std::string &name) {
+	std::string p(path);
+	size_t slash = p.rfind('/');
+	if(slash == std::string::npos) {
+		dir = ".";
+		name = p;
+	}
+	else {
+		if(slash)
+			dir = p.substr(0, slash);
+		else
+			dir = "/";
+		name = p.substr(slash + 1);
+	}
+}
+
+bool devwatch::watch(const char *path) {
+	log4cpp::Category &root = log4cpp::Category::getRoot();
+	if(m_fd < 0)
+		return false;
+
+	std::string dir, name;
+	split_path(path, dir, name);
+	// (Watching the same directory twice gets the same wd)
+	int wd = inotify_add_watch(m_fd, dir.c_str(),
+							   IN_CREATE|IN_ATTRIB|IN_MOVED_TO|
+							   IN_DELETE|IN_MOVED_FROM);
+	if(wd < 0) {
+		root.warn("Can't watch %s for %s (%s)", dir.c_str(), path,
+				  strerror(errno));
+		return false;
+	}
+	watched w;
+	w.wd = wd;
+	w.dir = dir;
+	w.name = name;
+	w.events = 0;
+	m_watched.push_back(w);
+	return true;
+}
+
+void devwatch::heard(const char *buffer, int len) {
+	for(int at = 0; at < len;) {
+		const struct inotify_event *e =
+			(const struct inotify_event *)(buffer + at);
+		at += sizeof(*e) + e->len;
+		if(e->len == 0)
+			continue;			// (about the directory itself)
+		int flag = (e->mask & (IN_DELETE|IN_MOVED_FROM)) ? DEV_GONE :
+			DEV_APPEARED;
+		for(auto w = m_watched.begin(); w != m_watched.end(); w++)
+			if(w->wd == e->wd && w->name == e->name)
+				w->events |= flag;
+	}
+}
+
+bool devwatch::wait(long ms) {
+	if(m_fd < 0) {
+		if(ms > 0)
+			usleep(ms * 1000);	// (all I can do)
+		return false;
+	}
+
+	bool news = false;
+	for(;;) {
+		char buffer[4096]
+			__attribute__((aligned(__alignof__(struct inotify_event))));
+		int len = read(m_fd, buffer, sizeof(buffer));
+		if(len > 0) {
+			heard(buffer, len);
+			for(auto w = m_watched.begin(); w != m_watched.end(); w++)
+				if(w->events)
+					news = true;
+			continue;			// (there may be more)
+		}
+		if(len < 0 && errno == EINTR)
+			continue;
+		if(news || ms <= 0)
+			return news;
+
+		// Nothing yet: wait for something
+		struct pollfd fds[1];
+		fds[0].fd = m_fd;
+		fds[0].events = POLLIN;
+		fds[0].revents = 0;
+		if(poll(fds, 1, ms) <= 0)
+			return false;		// (timed out)
+		ms = 0;					// (read what came, and that's it)
+	}
+}
+
+int devwatch::take(const char *path) {
+	if(path == NULL)
+		return 0;
+	std::string dir, name;
+	split_path(path, dir, name);
+	int events = 0;
+	for(auto w = m_watched.begin(); w != m_watched.end(); w++)
+		if(w->dir == dir && w->name == name) {
+			events |= w->events;
+			w->events = 0;
+		}
+	return events;
+}
@@ -0,0 +1,47 @@
+#ifndef DEVWATCH_H
+#define DEVWATCH_H
+
+// Hotplug: hears (by inotify on their directories) when serial device
+// nodes appear or go, so a port can be reopened the moment its adapter
+// is back, instead of on the next try of a retry loop.  A node whose
+// directory can't be watched (it isn't there yet, say) just isn't
+// heard from; callers still retry now and then.
+
+#include <string>
+#include <vector>
+
+#define DEV_APPEARED 0x01		// created, renamed into place, or its
+								// attributes changed (permissions, by udev)
+#define DEV_GONE 0x02
+
+class devwatch {
+protected:
+	int m_fd;					// inotify descriptor, or -1
+	struct watched {
+		int wd;					// its directory's watch
+		std::string dir, name;
+		int events;				// DEV_ flags heard, not yet taken
+	};
+	std::vector<watched> m_watched;
+
+	void heard(const char *buffer, int len);
+
+public:
+	devwatch();
+	~devwatch();
+
+	bool watch(const char *path); // false if I can't (logged)
+
+	// Wait up to "ms" milliseconds (0: don't wait) for news of the
+	// watched nodes.  Returns whether there was any.
+	bool wait(long ms);
+
+	// What's been heard of the node at "path" since I last said, as
+	// DEV_ flags
+	int take(const char *path);
+
+	inline int fd(void) const { return m_fd; } // (to poll, readable
+											   // when there's news)
+};
+
+#endif // DEVWATCH_H
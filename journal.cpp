@@ -0,0 +1,349 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+
+#include "log4cpp.h"
+
+#include "crc16.h"
+#include "journal.h"
+
+// File layout: a header, then records, each padded to 8 bytes.  A
+// record's magic is stored last, after everything else is in place,
+// so a record torn by a crash is never mistaken for a whole one (and
+// its CRC guards against a torn write-back after power loss).
+// Serial numbers run on from record to record; a record whose serial
+// isn't the next one expected is left over from an earlier lap of the
+// circle, and marks the end of the log.
+
+#define JOURNAL_MAGIC 0x4A44534F	// "OSDJ"
+#define RECORD_MAGIC 0x52445350		// "PSDR"
+#define JOURNAL_DATA 64			// records start here
+
+struct journal_header {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t size;
+	uint64_t head;				// oldest record that may be live
+	uint32_t head_serial;
+};
+
+enum { REC_LIVE = 1, REC_DONE = 2, REC_WRAP = 3 };
+
+struct journal_record {
+	uint32_t magic;
+	uint32_t serial;
+	uint16_t len;				// of the payload
+	uint8_t addr;
+	uint8_t state;
+	uint16_t crc;				// of the payload
+	uint16_t pad;
+	uuid_t uuid;
+	uint8_t data[];
+};
+
+static inline size_t record_size(size_t len) {
+	return (sizeof(journal_record) + len + 7) & ~(size_t)7;
+}
+
+journal::journal()
+	: m_fd(-1), m_map(NULL), m_size(0),
+	  m_head(JOURNAL_DATA), m_tail(JOURNAL_DATA), m_used(0), m_live_bytes(0),
+	  m_head_serial(1), m_serial(1), m_sync_ms(0), m_next_id(0) {
+	pthread_mutex_init(&m_lock, NULL);
+}
+
+journal::~journal() {
+	if(m_map) {
+		msync(m_map, m_size, MS_SYNC);
+		munmap(m_map, m_size);
+	}
+	if(m_fd >= 0)
+		::close(m_fd);
+}
+
+bool journal::open(const char *path, size_t size, int sync_ms) {
+	log4cpp::Category &root = log4cpp::Category::getRoot();
+
+	m_fd = ::open(path, O_RDWR|O_CREAT, 0600);
+	if(m_fd < 0) {
+		root.error("journal %s: open failed, errno %d", path, errno);
+		return false;
+	}
+	struct stat st;
+	fstat(m_fd, &st);
+	if((size_t)st.st_size > size)
+		size = st.st_size;		// (keep what a bigger one recorded)
+	if(ftruncate(m_fd, size) < 0) {
+		root.error("journal %s: can't size it, errno %d", path, errno);
+		return false;
+	}
+	m_map = (uint8_t *)mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED,
+							m_fd, 0);
+	if(m_map == MAP_FAILED) {
+		m_map = NULL;
+		root.error("journal %s: mmap failed, errno %d", path, errno);
+		return false;
+	}
+	m_size = size;
+
+	journal_header *h = (journal_header *)m_map;
+	if(h->magic != JOURNAL_MAGIC || h->version != 1 || h->size != m_size ||
+	   h->head < JOURNAL_DATA || h->head >= m_size) {
+		// New (or unusable): start empty
+		memset(m_map, 0, JOURNAL_DATA);
+		h->version = 1;
+		h->size = m_size;
+		save_head();
+		h->magic = JOURNAL_MAGIC;
+	}
+	else
+		scan();
+
+	root.info("journal %s: %zu live commands", path, m_live.size());
+
+	m_sync_ms = sync_ms;
+	if(m_sync_ms > 0)
+		pthread_create(&m_syncer, NULL, syncer_main, (void *)this);
+	return true;
+}
+
+void journal::scan(void) {
+	// Walk from the saved head for as long as the serials follow on
+	journal_header *h = (journal_header *)m_map;
+	size_t off = h->head;
+	uint32_t serial = h->head_serial;
+	m_head = off;
+	m_head_serial = serial;
+	m_used = 0;
+	m_live_bytes = 0;
+	for(;;) {
+		if(m_size - off < sizeof(journal_record))
+			off = JOURNAL_DATA;	// (no room for a record at the end)
+		journal_record *r = (journal_record *)(m_map + off);
+		if(r->magic != RECORD_MAGIC || r->serial != serial)
+			break;				// end of the log
+		if(r->state == REC_WRAP) {
+			serial++;
+			off = JOURNAL_DATA;
+			continue;
+		}
+		size_t rs = record_size(r->len);
+		if(off + rs > m_size)
+			break;
+		uint16_t crc;
+		crc16_prepare(crc);
+		crc = crc16_add(crc, r->data, r->len);
+		if(crc16_digest(crc) != r->crc)
+			break;				// torn
+		if(r->state == REC_LIVE) {
+			entry e;
+			e.id = m_next_id++;
+			m_where[e.id] = off;
+			m_live_bytes += rs;
+			e.addr = r->addr;
+			memcpy(e.uuid, r->uuid, sizeof(uuid_t));
+			e.data = blob(r->data, r->len);
+			m_live.push_back(e);
+		}
+		m_used += rs;
+		serial++;
+		off += rs;
+	}
+	m_tail = off;
+	m_serial = serial;
+	advance();					// (reclaim any done ones up front)
+}
+
+void journal::take_live(std::vector<entry> &live) {
+	live.swap(m_live);
+	m_live.clear();
+}
+
+void journal::save_head(void) {
+	journal_header *h = (journal_header *)m_map;
+	h->head = m_head;
+	h->head_serial = m_head_serial;
+}
+
+size_t journal::room(size_t rs, bool &wrap) {
+	// Free space is from the tail to the end, then from the top to
+	// the head.
+	size_t off = m_tail;
+	wrap = false;
+	if(off >= m_head && m_used > 0) {
+		if(off + rs > m_size) {
+			if(JOURNAL_DATA + rs >= m_head)
+				return 0;		// full
+			wrap = true;
+			off = JOURNAL_DATA;
+		}
+	}
+	else if(m_used > 0 && off + rs >= m_head)
+		return 0;				// full
+	else if(off + rs > m_size)
+		return 0;				// bigger than the whole journal
+	return off;
+}
+
+size_t journal::put(size_t off, bool wrap, uint8_t addr, const uuid_t uuid,
+					const void *data, int len) {
+	if(wrap && m_size - m_tail >= sizeof(journal_record)) {
+		// Mark the end of this lap (the record starts at the top)
+		journal_record *w = (journal_record *)(m_map + m_tail);
+		w->serial = m_serial;
+		w->len = 0;
+		w->state = REC_WRAP;
+		__sync_synchronize();
+		w->magic = RECORD_MAGIC;
+		m_serial++;
+	}
+
+	journal_record *r = (journal_record *)(m_map + off);
+	r->serial = m_serial++;
+	r->len = len;
+	r->addr = addr;
+	r->state = REC_LIVE;
+	memcpy(r->uuid, uuid, sizeof(uuid_t));
+	memcpy(r->data, data, len);
+	uint16_t crc;
+	crc16_prepare(crc);
+	crc = crc16_add(crc, r->data, len);
+	r->crc = crc16_digest(crc);
+	__sync_synchronize();		// (everything else lands first)
+	r->magic = RECORD_MAGIC;
+
+	size_t rs = record_size(len);
+	m_tail = off + rs;
+	m_used += rs;
+	m_live_bytes += rs;
+	return off;
+}
+
+bool journal::carry(void) {
+	// Copy the live record at the head to the tail, and reclaim it and
+	// the done ones behind it.  (A crash in between leaves both copies
+	// live, and the command is replayed twice.)
+	if(m_used == m_live_bytes)
+		return false;			// all live: nothing to gain
+	journal_record *r = (journal_record *)(m_map + m_head);
+	size_t rs = record_size(r->len);
+	bool wrap;
+	size_t off = room(rs, wrap);
+	if(off == 0)
+		return false;
+	put(off, wrap, r->addr, r->uuid, r->data, r->len);
+	for(auto i = m_where.begin(); i != m_where.end(); i++)
+		if(i->second == m_head)
+			i->second = off;	// (whoever has it, it's here now)
+	r->state = REC_DONE;
+	m_live_bytes -= rs;
+	advance();
+	return true;
+}
+
+long journal::append(uint8_t addr, const uuid_t uuid, const void *data, int len) {
+	if(m_map == NULL || len < 0 || len > 0xFFFF)
+		return -1;
+	size_t rs = record_size(len);
+
+	pthread_mutex_lock(&m_lock);
+	if(m_used == 0) {
+		m_head = m_tail = JOURNAL_DATA; // empty: start at the top
+		m_head_serial = m_serial;
+		save_head();
+	}
+	// Past three quarters full, move live records out of the way of
+	// the done ones behind them (while there's room to move them to)
+	while(m_used > (m_size - JOURNAL_DATA) / 4 * 3 && carry())
+		;
+	bool wrap;
+	size_t off;
+	while((off = room(rs, wrap)) == 0 && carry())
+		;
+	if(off == 0) {
+		pthread_mutex_unlock(&m_lock);
+		return -1;
+	}
+	put(off, wrap, addr, uuid, data, len);
+	long id = m_next_id++;
+	m_where[id] = off;
+	pthread_mutex_unlock(&m_lock);
+	return id;
+}
+
+void journal::done(long id) {
+	if(m_map == NULL || id < 0)
+		return;
+	pthread_mutex_lock(&m_lock);
+	auto i = m_where.find(id);
+	if(i != m_where.end()) {
+		journal_record *r = (journal_record *)(m_map + i->second);
+		m_where.erase(i);
+		if(r->magic == RECORD_MAGIC && r->state == REC_LIVE) {
+			r->state = REC_DONE;
+			m_live_bytes -= record_size(r->len);
+			advance();
+		}
+	}
+	pthread_mutex_unlock(&m_lock);
+}
+
+int journal::usage(char *text, int size) {
+	pthread_mutex_lock(&m_lock);
+	int len = snprintf(text, size,
+					   "{\"size\":%zu,\"used\":%zu,\"live\":%zu,"
+					   "\"live_records\":%zu}",
+					   m_size - JOURNAL_DATA, m_used, m_live_bytes,
+					   m_where.size());
+	pthread_mutex_unlock(&m_lock);
+	return len;
+}
+
+void journal::advance(void) {
+	// Reclaim done records from the head, oldest first.  (A live
+	// record holds back the ones behind it, until it's done or
+	// append() carries it forward.)
+	size_t off = m_head;
+	while(m_used > 0) {
+		if(m_size - off < sizeof(journal_record)) {
+			off = JOURNAL_DATA;
+			continue;
+		}
+		journal_record *r = (journal_record *)(m_map + off);
+		if(r->state == REC_WRAP) {
+			off = JOURNAL_DATA;
+			m_head_serial++;
+			continue;
+		}
+		if(r->state != REC_DONE)
+			break;
+		size_t rs = record_size(r->len);
+		off += rs;
+		m_used -= rs;
+		m_head_serial++;
+	}
+	m_head = off;
+	if(m_used == 0) {
+		m_head = m_tail = JOURNAL_DATA;
+		m_head_serial = m_serial;
+	}
+	save_head();
+}
+
+void *journal::syncer_main(void *param) {
+	journal *j = (journal *)param;
+	for(;;) {
+		struct timespec ts;
+		ts.tv_sec = j->m_sync_ms / 1000;
+		ts.tv_nsec = (j->m_sync_ms % 1000) * 1000000;
+		nanosleep(&ts, NULL);
+		msync(j->m_map, j->m_size, MS_SYNC);
+	}
+	return 0;
+}
@@ -0,0 +1,87 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+// A crash-safe journal of durable outgoing commands.  It's a circular
+// log in a memory-mapped file: appending is a memcpy into the mapping,
+// and once a PD ACKs a command its record is marked done and the
+// oldest done records are reclaimed.  When it's filling up, live records
+// at the head are copied forward to the tail, so one that's never ACKed
+// can't hold back the reclaiming of those behind it.  At startup,
+// whatever is still live is replayed into the slaves' queues.
+
+#include <pthread.h>
+
+#include <cstdint>
+#include <map>
+#include <vector>
+
+#include "uuid.h"
+
+#include "blob.h"
+
+class journal {
+public:
+	// A live record found when the journal is opened
+	struct entry {
+		long id;
+		uint8_t addr;
+		uuid_t uuid;
+		blob data;
+	};
+
+protected:
+	int m_fd;
+	uint8_t *m_map;
+	size_t m_size;				// of the whole file
+
+	// The live region runs from m_head to m_tail, wrapping around
+	size_t m_head;
+	size_t m_tail;
+	size_t m_used;				// bytes of records in it
+	size_t m_live_bytes;		// ...of those, live ones
+	uint32_t m_head_serial;		// serial number of the record at m_head
+	uint32_t m_serial;			// serial number for the next append
+
+	pthread_mutex_t m_lock;
+	pthread_t m_syncer;
+	int m_sync_ms;				// msync period
+
+	std::vector<entry> m_live;	// (found by open(), until taken)
+
+	// Where each live record is now (they move), by the id append()
+	// gave out
+	std::map<long, size_t> m_where;
+	long m_next_id;
+
+	void scan(void);
+	size_t room(size_t rs, bool &wrap); // where rs bytes would go, or 0
+	size_t put(size_t off, bool wrap, uint8_t addr, const uuid_t uuid,
+			   const void *data, int len);
+	bool carry(void);			// move the live record at m_head
+	void advance(void);			// reclaim done records at m_head
+	void save_head(void);
+	static void *syncer_main(void *param);
+
+public:
+	journal();
+	~journal();
+
+	// Map the journal file, creating it if need be.  Returns false
+	// (having logged why) if it can't.
+	bool open(const char *path, size_t size, int sync_ms);
+
+	// Record a command; returns its id (to give to done()) or -1 if
+	// there's no room, even with the live records packed together.
+	long append(uint8_t addr, const uuid_t uuid, const void *data, int len);
+
+	void done(long id);			// the PD ACKed it
+
+	// For the bus stats
+	int usage(char *text, int size);
+
+	// The live records found by open(), oldest first.  Whoever takes
+	// them is responsible for eventually calling done() on each.
+	void take_live(std::vector<entry> &live);
+};
+
+#endif // JOURNAL_H
@@ -55,12 +55,14 @@ typedef volatile int katomic_t;	// The data type of our atomic counter
 // I need to be compatable with ARM targets as well.
 // So, use the GCC compiler intrinsics.
 
-static inline katomic_t katomic_add(katomic_t *c, unsigned int incr)
+// (They return the old value as a plain int: C++20 won't have a
+// volatile return type.)
+static inline int katomic_add(katomic_t *c, unsigned int incr)
 {
 	return __sync_fetch_and_add(c, incr);
 }
 
-static inline katomic_t katomic_inc(katomic_t *c)
+static inline int katomic_inc(katomic_t *c)
 {
 	return __sync_fetch_and_add(c, 1);
 }
@@ -32,6 +32,7 @@ extern "C" {
 #define OSDP_SCRYPT 0x77
 #define OSDP_ABORT 0x7A
 #define OSDP_MAXREPLY 0x7B
+#define OSDP_FILETRANSFER 0x7C
 #define OSDP_MFG 0x80
 
 #define OSDP_ACK 0x40
@@ -52,6 +53,10 @@ extern "C" {
 #define OSDP_RMAC_I 0x78
 #define OSDP_MFGREP 0x90
 #define OSDP_BUSY 0x79
+#define OSDP_FTSTAT 0x7A
+
+// osdp_NAK error codes
+#define OSDP_NAK_SEQUENCE 0x04
 
 #pragma pack(1)
 #ifndef T_OSDP_COMMON
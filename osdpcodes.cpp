@@ -0,0 +1,70 @@
+#include <cstring>
+#include <cstdlib>
+#include <strings.h>
+
+#include "osdp_def.h"
+#include "osdpcodes.h"
+
+struct code_name {
+	uint8_t code;
+	const char *name;
+};
+
+#define CODE(n) { OSDP_##n, #n }
+
+static const code_name commands[] = {
+	CODE(POLL), CODE(ID), CODE(CAP), CODE(DIAG), CODE(LSTAT),
+	CODE(ISTAT), CODE(OSTAT), CODE(RSTAT), CODE(OUT), CODE(LED),
+	CODE(BUZ), CODE(TEXT), CODE(TDSET), CODE(COMSET), CODE(DATA),
+	CODE(PROMPT), CODE(BIOREAD), CODE(BIOMATCH), CODE(KEYSET),
+	CODE(CHLNG), CODE(SCRYPT), CODE(ABORT), CODE(MAXREPLY), CODE(FILETRANSFER),
+	CODE(MFG),
+	{ 0, NULL }
+};
+
+static const code_name replies[] = {
+	CODE(ACK), CODE(NAK), CODE(PDID), CODE(PDCAP), CODE(LSTATR),
+	CODE(ISTATR), CODE(OSTATR), CODE(RSTATR), CODE(RAW), CODE(FMT),
+	CODE(KEYPAD), CODE(COM), CODE(BIOREADR), CODE(BIOMATCHR),
+	CODE(CCRYPT), CODE(RMAC_I), CODE(MFGREP), CODE(BUSY), CODE(FTSTAT),
+	{ 0, NULL }
+};
+
+#undef CODE
+
+static const char *name_of(const code_name *table, uint8_t code) {
+	for(; table->name; table++)
+		if(table->code == code)
+			return table->name;
+	return NULL;
+}
+
+static int code_of(const code_name *table, const char *name) {
+	if(strncasecmp(name, "OSDP_", 5) == 0)
+		name += 5;
+	for(; table->name; table++)
+		if(strcasecmp(table->name, name) == 0)
+			return table->code;
+
+	char *end;
+	unsigned long code = strtoul(name, &end, 0);
+	if(end == name || *end != '\0' || code > 0xFF)
+		return -1;
+	return (int)code;
+}
+
+const char *osdp_command_name(uint8_t code) {
+	return name_of(commands, code);
+}
+
+const char *osdp_reply_name(uint8_t code) {
+	return name_of(replies, code);
+}
+
+int osdp_command_code(const char *name) {
+	return code_of(commands, name);
+}
+
+int osdp_reply_code(const char *name) {
+	return code_of(replies, name);
+}
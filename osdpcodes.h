@@ -0,0 +1,17 @@
+#ifndef OSDPCODES_H
+#define OSDPCODES_H
+
+// Names for the command and reply codes in osdp_def.h, for config
+// files and logs.
+
+#include <cstdint>
+
+const char *osdp_command_name(uint8_t code); // "POLL", or NULL if unknown
+const char *osdp_reply_name(uint8_t code);	  // "LSTATR", or NULL
+
+// Look up a code by name ("LSTATR" or "OSDP_LSTATR") or by number
+// ("0x48", "72").  Returns -1 if it's neither.
+int osdp_command_code(const char *name);
+int osdp_reply_code(const char *name);
+
+#endif // OSDPCODES_H
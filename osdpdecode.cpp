@@ -0,0 +1,208 @@
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+
+#include "osdp_def.h"
+#include "osdpcodes.h"
+#include "osdpdecode.h"
+
+// How a reply's bytes are laid out: fields one after another, each
+// starting where the last one ended.  (Multi-byte numbers are
+// little-endian, as OSDP has them.)
+typedef enum {
+	F_U8,
+	F_U16,
+	F_S16,
+	F_U32,
+	F_VENDOR,					// 3-byte vendor code, as hex
+	F_BITS,						// as hex; as many bits as the last number
+	F_BYTES,					// the rest, as an array of numbers
+	F_TRIPLES,					// the rest, as an array of 3-number arrays
+	F_HEX,						// the rest, as hex
+	F_TEXT,						// the rest, as a string
+	F_END
+} fieldtype_t;
+
+struct field {
+	const char *name;
+	fieldtype_t type;
+};
+
+#define FIELDS_MAX 8
+
+struct layout {
+	uint8_t code;
+	field fields[FIELDS_MAX];
+};
+
+static const layout layouts[] = {
+	{ OSDP_ACK, { { NULL, F_END } } },
+	{ OSDP_BUSY, { { NULL, F_END } } },
+	{ OSDP_NAK, { { "error", F_U8 }, { NULL, F_END } } },
+	{ OSDP_PDID, { { "vendor", F_VENDOR }, { "model", F_U8 },
+				   { "version", F_U8 }, { "serial", F_U32 },
+				   { "fw_major", F_U8 }, { "fw_minor", F_U8 },
+				   { "fw_build", F_U8 }, { NULL, F_END } } },
+	{ OSDP_PDCAP, { { "capabilities", F_TRIPLES }, { NULL, F_END } } },
+	{ OSDP_LSTATR, { { "tamper", F_U8 }, { "power", F_U8 },
+					 { NULL, F_END } } },
+	{ OSDP_ISTATR, { { "inputs", F_BYTES }, { NULL, F_END } } },
+	{ OSDP_OSTATR, { { "outputs", F_BYTES }, { NULL, F_END } } },
+	{ OSDP_RSTATR, { { "readers", F_BYTES }, { NULL, F_END } } },
+	{ OSDP_RAW, { { "reader", F_U8 }, { "format", F_U8 }, { "bits", F_U16 },
+				  { "data", F_BITS }, { NULL, F_END } } },
+	{ OSDP_FMT, { { "reader", F_U8 }, { "direction", F_U8 },
+				  { "length", F_U8 }, { "text", F_TEXT }, { NULL, F_END } } },
+	{ OSDP_KEYPAD, { { "reader", F_U8 }, { "count", F_U8 },
+					 { "digits", F_TEXT }, { NULL, F_END } } },
+	{ OSDP_COM, { { "address", F_U8 }, { "baud", F_U32 }, { NULL, F_END } } },
+	{ OSDP_BIOREADR, { { "reader", F_U8 }, { "status", F_U8 },
+					   { "type", F_U8 }, { "quality", F_U8 },
+					   { "length", F_U16 }, { "template", F_HEX },
+					   { NULL, F_END } } },
+	{ OSDP_BIOMATCHR, { { "reader", F_U8 }, { "status", F_U8 },
+						{ "score", F_U8 }, { NULL, F_END } } },
+	{ OSDP_MFGREP, { { "vendor", F_VENDOR }, { "data", F_HEX },
+					 { NULL, F_END } } },
+	{ 0x7A, { { "action", F_U8 }, { "delay", F_U16 },	// FTSTAT
+			  { "status", F_S16 }, { "msgmax", F_U16 }, { NULL, F_END } } },
+};
+
+static const layout *layout_of(uint8_t code) {
+	for(size_t i = 0; i < sizeof(layouts)/sizeof(layouts[0]); i++)
+		if(layouts[i].code == code)
+			return &layouts[i];
+	return NULL;
+}
+
+// Appends to a bounded buffer, snprintf-style: the length keeps
+// counting past the end, and the text is always terminated.
+struct jsonout {
+	char *buf;
+	size_t size;
+	int len;
+
+	void add(const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+	void hex(const uint8_t *p, int n) {
+		add("\"");
+		for(int i = 0; i < n; i++)
+			add("%02X", p[i]);
+		add("\"");
+	}
+	void text(const uint8_t *p, int n) {
+		add("\"");
+		for(int i = 0; i < n; i++) {
+			if(p[i] == '"' || p[i] == '\\')
+				add("\\%c", p[i]);
+			else if(p[i] < 0x20 || p[i] > 0x7E)
+				add("\\u%04X", p[i]);
+			else
+				add("%c", p[i]);
+		}
+		add("\"");
+	}
+};
+
+void jsonout::add(const char *fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	size_t room = (size_t)len < size ? size - len : 0;
+	len += vsnprintf(room ? buf + len : NULL, room, fmt, ap);
+	va_end(ap);
+}
+
+int osdp_decode(const uint8_t *reply, int len, char *json, size_t size) {
+	if(len < 1)
+		return -1;
+	uint8_t code = reply[0];
+	const uint8_t *p = reply + 1, *end = reply + len;
+
+	jsonout out = { json, size, 0 };
+	if(size > 0)
+		json[0] = '\0';
+	const char *name = osdp_reply_name(code);
+	if(name)
+		out.add("{\"reply\":\"%s\"", name);
+	else
+		out.add("{\"reply\":\"0x%02X\"", code);
+
+	const layout *l = layout_of(code);
+	if(l == NULL) {
+		// Not one I know the insides of
+		if(p < end) {
+			out.add(",\"data\":");
+			out.hex(p, end - p);
+		}
+		out.add("}");
+		return out.len;
+	}
+
+	long number = 0;			// (the last number, for F_BITS)
+	for(const field *f = l->fields; f->type != F_END; f++) {
+		int need;
+		switch(f->type) {
+		case F_U8: need = 1; break;
+		case F_U16: case F_S16: need = 2; break;
+		case F_U32: need = 4; break;
+		case F_VENDOR: need = 3; break;
+		case F_BITS: need = (number + 7) / 8; break;
+		default: need = 0; break;
+		}
+		if(end - p < need) {
+			out.add(",\"truncated\":true");
+			break;
+		}
+
+		out.add(",\"%s\":", f->name);
+		switch(f->type) {
+		case F_U8:
+			number = p[0];
+			out.add("%ld", number);
+			break;
+		case F_U16:
+			number = p[0] | p[1] << 8;
+			out.add("%ld", number);
+			break;
+		case F_S16:
+			number = (int16_t)(p[0] | p[1] << 8);
+			out.add("%ld", number);
+			break;
+		case F_U32:
+			number = (long)((uint32_t)p[0] | (uint32_t)p[1] << 8 |
+							(uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+			out.add("%ld", number);
+			break;
+		case F_VENDOR:
+		case F_BITS:
+			out.hex(p, need);
+			break;
+		case F_BYTES:
+			out.add("[");
+			for(const uint8_t *b = p; b < end; b++)
+				out.add(b == p ? "%d" : ",%d", *b);
+			out.add("]");
+			need = end - p;
+			break;
+		case F_TRIPLES:
+			out.add("[");
+			for(const uint8_t *b = p; end - b >= 3; b += 3)
+				out.add("%s[%d,%d,%d]", b == p ? "" : ",", b[0], b[1], b[2]);
+			out.add("]");
+			need = end - p;
+			break;
+		case F_HEX:
+			out.hex(p, end - p);
+			need = end - p;
+			break;
+		case F_TEXT:
+			out.text(p, end - p);
+			need = end - p;
+			break;
+		case F_END:
+			break;
+		}
+		p += need;
+	}
+	out.add("}");
+	return out.len;
+}
@@ -0,0 +1,21 @@
+#ifndef OSDPDECODE_H
+#define OSDPDECODE_H
+
+// Render a PD reply as compact JSON, so MQTT subscribers needn't each
+// pick the bytes apart themselves.  Replies are decoded by a table
+// of field layouts keyed on the reply code; codes not in the table
+// come out as their name and the data in hex.
+
+#include <cstddef>
+#include <cstdint>
+
+// "reply" starts with the reply code.  Returns the length of the
+// JSON (which may have been truncated to fit "size", as snprintf
+// does), or -1 if there's nothing to decode.
+int osdp_decode(const uint8_t *reply, int len, char *json, size_t size);
+
+// Room for the JSON of any reply of "len" bytes: a byte of text comes
+// out as at most 6 ("\u00XX"), plus the names and punctuation
+#define OSDP_DECODE_MAX(len) (6 * (len) + 256)
+
+#endif // OSDPDECODE_H
@@ -4,13 +4,9 @@
 #include <pthread.h>
 
 #include <iostream>
-#include <sstream>
-#include <iomanip>
 
 #include <vector>
 
-#include <cassert>
-
 #include <mosquitto.h>
 
 #include <boost/property_tree/ptree.hpp>
@@ -18,8 +14,10 @@
 
 #include "osdpslave.h"
 #include "osdpmaster.h"
+#include "osdpcodes.h"
 
 #include "split.h"
+#include "timespec.h"
 
 using namespace std;
 using namespace boost;
@@ -38,123 +36,139 @@ void mosq_errcheck(int mosqe, const char *context) {
 	}
 }
 
-void logprotocol::datalog(const char *prefix, const uint8_t *buffer, int len) {
-	// Since log4cpp insists every log is a line,
-	// build whole lines
-	while(len > 0) {
-		int somelen = len;
-		if(somelen > 16)
-			somelen = 16;
-		std::ostringstream line;
-		line.fill('0');
-		line.setf(ios::hex|ios::uppercase,
-				  ios::basefield|ios::uppercase);
-		const char *space = "";
-		for(int i = 0; i < somelen; i++) {
-			line << space << setw(2) << (int)buffer[i];
-			space = " ";
-		}
-				
-		log4cpp::Category &root = log4cpp::Category::getRoot();
-		root.debug("%s: %s", prefix, line.str().c_str());
-
-		buffer += somelen;
-		len -= somelen;
-	}
+void mqtttransport::slave_topic(const osdpslave &s, const char *what,
+								char *topic, size_t size) const {
+	char name[37];
+	if(mem_zero(s.uuid(), sizeof(uuid_t)))
+		snprintf(name, sizeof(name), "%d", (int)s.addr());
+	else
+		uuid_unparse(s.uuid(), name);
+	snprintf(topic, size, "osdpiom/bus%d/incoming/%s/%s", m_busno, name, what);
 }
 
-osdpslave &busprotocol::add_slave(const char *addr) {
-	// A static slave.
-	uint32_t a = strtoul(addr, NULL, 10);
-	m_slaves.push_back(osdpslave(this));
-	osdpslave &s = m_slaves.back();
-	s.addr(a);
-	s.init();
+const mqtttransport::slave_topics &mqtttransport::topics(const osdpslave &s) {
+	slave_topics &t = m_topics[&s];
+	if(t.incoming[0] && t.addr == s.addr() &&
+	   memcmp(t.uuid, s.uuid(), sizeof(uuid_t)) == 0)
+		return t;				// (still good)
+
+	t.addr = s.addr();
+	memcpy(t.uuid, s.uuid(), sizeof(uuid_t));
+	snprintf(t.incoming, sizeof(t.incoming),
+			 "osdp/bus%d/incoming/%d", m_busno, (int)t.addr);
+	snprintf(t.card, sizeof(t.card),
+			 "osdp/bus%d/incoming/%d/card", m_busno, (int)t.addr);
+	snprintf(t.keypad, sizeof(t.keypad),
+			 "osdp/bus%d/incoming/%d/keypad", m_busno, (int)t.addr);
+	snprintf(t.access, sizeof(t.access),
+			 "osdp/bus%d/incoming/%d/access", m_busno, (int)t.addr);
+	slave_topic(s, "stats", t.stats, sizeof(t.stats));
+	slave_topic(s, "file", t.file, sizeof(t.file));
+	return t;
+}
 
-	m_poll_slave = m_slaves.begin();
-	return s;
+void mqtttransport::reply(osdpslave &s, const uint8_t *reply, int len) {
+	m_pub->reply(topics(s).incoming, reply, len);
 }
 
-void busprotocol::init(void) {
-	// add_slave already took care of this
+void mqtttransport::card(osdpslave &s, const uint8_t *reply, int len) {
+	const slave_topics &t = topics(s);
+	m_pub->fast(reply[0] == OSDP_KEYPAD ? t.keypad : t.card, reply, len);
 }
 
-void *busprotocol_run(void *param) {
-	busprotocol *proto = (busprotocol *)param;
-	try {
-		proto->run();
-	}
-	catch(std::exception &e) {
-		cerr << e.what() << endl;
-	}
-	return 0;
+void mqtttransport::answer(osdpslave &s, const osdpmsg &request,
+						   const uint8_t *reply, int len) {
+	// An MQTT v5 request: its reply goes back with its correlation
+	// data and timings.
+	pubcorr corr;
+	corr.data = request.correlation.pvoid();
+	corr.len = request.correlation.size();
+	corr.queued = request.queued;
+	corr.wire = s.m_wire;
+	clock_gettime(CLOCK_REALTIME, &corr.reply);
+	const char *topic = request.reply_to.empty() ?
+		topics(s).incoming : request.reply_to.c_str();
+	m_pub->publish(PUB_REPLY, topic, reply, len, corr);
 }
 
-void busprotocol::run() {
+void mqtttransport::status(osdpslave &s, const char *status) {
+	// Set final arg "true" to make this the "first message" of the
+	// topic.  The MQTT broker will keep a copy, and any app that
+	// subscribes will get this message first, and then any other
+	// messages, including new "firsts".
 	log4cpp::Category &root = log4cpp::Category::getRoot();
+	char topic[PUBLISHER_TOPIC_SIZE];
+	slave_topic(s, "status", topic, sizeof(topic));
+	root.info("Publishing status %s = %s", topic, status);
+	m_pub->publish(PUB_STATUS, topic, status, strlen(status), true);
+}
 
-	bool first = true;
-	for(;;) {
-		try {
-			prepcom();			// Connect & prepare to run the port
-			break;				// got it
-		}
-		catch(protocol_exception e) {
-			if(first) {
-				root.error("Failed to open %s, waiting...", m_config.port);
-				first = false;
-			}
-		}
-		if(m_port2) {
-			// Switch ports
-			const char *t = m_config.port;
-			m_config.port = m_port2;
-			m_port2 = t;
-		}
-		sleep(5);
-	}
-	root.error("Port %s opened", m_config.port);
-	root.error("m_config.delay = %u", m_config.delay);
-	root.error("m_config.timeout = %u", m_config.timeout);
-	for(;;) {
-		polled_t polled = DIDNT_POLL;
-
-		/*
-		 * There's a queue of outgoing messages per slave, and
-		 * there's a bus-global queue.  The bus-global queue is for
-		 * address-assignment messages and inquiries, and
-		 * I give it precedence.
-		 */
-
-		try {
-			polled = slave_poll();
-		}
-		catch(protocol_exception e) {
-			log4cpp::Category &root = log4cpp::Category::getRoot();
-			root.error("Error while polling, %s", e.what());
+void mqtttransport::decided(osdpslave &s, const uint8_t *card, int len,
+							bool grant) {
+	char json[32 + 2*CREDCACHE_KEY_MAX];
+	int n = snprintf(json, sizeof(json), "{\"card\":\"");
+	for(int i = 0; i < len && n < (int)sizeof(json) - 24; i++)
+		n += snprintf(json + n, sizeof(json) - n, "%02X", card[i]);
+	n += snprintf(json + n, sizeof(json) - n, "\",\"decision\":\"%s\"}",
+				  grant ? "grant" : "deny");
+	m_pub->decision(topics(s).access, json, n);
+}
 
-			close();			// I/O error (like, unplugged USB cable)
+void mqtttransport::rejected(osdpslave &s, const char *limit, long mid) {
+	char topic[PUBLISHER_TOPIC_SIZE];
+	slave_topic(s, "error", topic, sizeof(topic));
+	bool reply = strcmp(limit, "reply_to") == 0 ||
+		strcmp(limit, "correlation") == 0;
+	char text[128];
+	int len = snprintf(text, sizeof(text),
+					   "{\"error\":\"%s\",\"limit\":\"%s\","
+					   "\"mid\":%ld}", reply ? "reply too long" : "queue full",
+					   limit, mid);
+	m_pub->publish(PUB_STATUS, topic, text, len);
+}
 
-			for(;;) {
-				try {
-					prepcom();
-					break;		// Reopened
-				}
-				catch(protocol_exception e) {
-					// didn't reopen.
-				}
-				if(m_port2) {
-					// Switch ports
-					const char *t = m_config.port;
-					m_config.port = m_port2;
-					m_port2 = t;
-				}
-				sleep(5);		// wait a while
-			}
-			root.error("port %s reopened", m_config.port);
-		}
+void mqtttransport::monitored(uint8_t addr, bool pd,
+							  const uint8_t *frame, int len) {
+	char topic[PUBLISHER_TOPIC_SIZE];
+	snprintf(topic, sizeof(topic), "osdp/bus%d/monitor/%d/%s",
+			 m_busno, (int)addr, pd ? "pd" : "cp");
+	if(pd)
+		m_pub->reply(topic, frame, len); // (and decoded, if I'm decoding)
+	else
+		m_pub->publish(PUB_REPLY, topic, frame, len);
+}
 
-	} // end forever
+void mqtttransport::discovered(int addr, const char *json, int len) {
+	char topic[PUBLISHER_TOPIC_SIZE];
+	if(addr < 0)
+		snprintf(topic, sizeof(topic), "osdpiom/bus%d/discovered", m_busno);
+	else
+		snprintf(topic, sizeof(topic), "osdpiom/bus%d/discovered/%d",
+				 m_busno, addr);
+	m_pub->publish(PUB_STATUS, topic, json, len);
+}
+
+void mqtttransport::report(const char *kind, int addr,
+						   const char *json, int len) {
+	// Most go right under the bus; the monitor's are its stats, for
+	// the bus or one address on it
+	char topic[PUBLISHER_TOPIC_SIZE];
+	if(strcmp(kind, "monitor") != 0)
+		snprintf(topic, sizeof(topic), "osdpiom/bus%d/%s", m_busno, kind);
+	else if(addr < 0)
+		snprintf(topic, sizeof(topic), "osdpiom/bus%d/monitor/stats",
+				 m_busno);
+	else
+		snprintf(topic, sizeof(topic), "osdpiom/bus%d/monitor/%d/stats",
+				 m_busno, addr);
+	m_pub->publish(PUB_STATS, topic, json, len);
+}
+
+void mqtttransport::report(osdpslave &s, const char *kind,
+						   const char *json, int len) {
+	const slave_topics &t = topics(s);
+	m_pub->publish(PUB_STATS, strcmp(kind, "file") == 0 ? t.file : t.stats,
+				   json, len);
 }
 
 void xparse_config(struct serial_config &config, char **port2) {
@@ -197,205 +211,262 @@ void xparse_config(struct serial_config &config, char **port2) {
 	config.timeout = g_config.get<int>("port.timeout", 100000);
 	config.delay = g_config.get<int>("port.delay", 300);
 	config.idle = g_config.get<int>("port.idle", 300);
+	config.latency_timer = g_config.get<int>("port.latency_timer", 1);
+	config.echo_cancel = g_config.get<bool>("port.echo_cancel", true);
 }
 
-busprotocol::polled_t busprotocol::slave_poll(void) {
-	log4cpp::Category &root = log4cpp::Category::getRoot();
-	auto a = m_poll_slave;
-	bool sendmsg = false;
-
-	for(;;) {
-		a++;					 // Next
-		if(a == m_slaves.end()) // Past the end?
-			a = m_slaves.begin(); // roll back to start
-		if(a == m_poll_slave)
-			break;				// I went all the way 'round
-		if(a->defined() && a->enabled())
-			break;				// Found the next defined slave
-	}
-
-	m_poll_slave = a;
-	osdpslave &s = *a;
-
-	if(!s.defined() || !s.enabled()) // None pollable.
-		return DIDNT_POLL;
-
-	if(s.offline()) {
-		s.purge(); // clear out queued msgs (sorry dude)
-
-		// How to re-acquire a stopped slave: send address-assign
-		// every 5 seconds.
-
-		// Is it time to try another poll?
-		struct timespec now;
-		clock_gettime(CLOCK_MONOTONIC, &now);
-		//if(now < s.m_next_assign)
-		if(now.tv_sec < s.m_next_assign.tv_sec ||
-		   (now.tv_sec == s.m_next_assign.tv_sec &&
-			now.tv_nsec < s.m_next_assign.tv_nsec)) {
-			return DIDNT_POLL;		// Not time to tickle.
-		}
+// An outgoing topic, picked apart in place:
+// osdp/bus<n>/outgoing/<addr or UUID>[/<suffix>]
+struct outgoing_topic {
+	unsigned bus;
+	int addr;					// OSDP address, or -1 if given a UUID
+	uuid_t uuid;
+	const char *suffix;			// points into the topic; NULL if none
+};
+
+// Parse a decimal number of at most "digits" digits, advancing *p.
+static bool parse_number(const char **p, unsigned digits, unsigned *value) {
+	const char *s = *p;
+	unsigned v = 0;
+	while(*s >= '0' && *s <= '9' && s - *p < (long)digits)
+		v = v * 10 + (*s++ - '0');
+	if(s == *p)
+		return false;			// no digits at all
+	*p = s;
+	*value = v;
+	return true;
+}
 
-		// It needs a normal poll.
-		s.m_next_assign = now;
-		s.m_next_assign.tv_sec += 5; // 5 seconds until the next tickle
-		unsigned char pollmsg[1];
-		pollmsg[0] = OSDP_POLL;
-		flush_input();
-		writecook(s.addr(), s.txseq(), sizeof(pollmsg), pollmsg);
+static bool parse_outgoing(const char *topic, outgoing_topic &t) {
+	static const char prefix[] = "osdp/bus";
+	static const char middle[] = "/outgoing/";
+	const char *p = topic;
+
+	if(strncmp(p, prefix, sizeof(prefix)-1) != 0)
+		return false;
+	p += sizeof(prefix)-1;
+	if(!parse_number(&p, 3, &t.bus))
+		return false;
+	if(strncmp(p, middle, sizeof(middle)-1) != 0)
+		return false;
+	p += sizeof(middle)-1;
+
+	// The slave is named by its address or its UUID.  A UUID
+	// always takes 36 characters, an address at most 3.
+	const char *slash = strchr(p, '/');
+	size_t len = slash ? (size_t)(slash - p) : strlen(p);
+	if(len == 36) {
+		char text[37];			// uuid_parse wants it terminated
+		memcpy(text, p, 36);
+		text[36] = '\0';
+		if(uuid_parse(text, t.uuid) != 0)
+			return false;
+		t.addr = -1;
 	}
 	else {
-		// Module thought online, but it missed a poll
-		if(s.m_retry > 0) {
-			struct timespec now;
-			clock_gettime(CLOCK_MONOTONIC, &now);
-			if(now.tv_sec < s.m_next_poll.tv_sec ||
-			   (now.tv_sec == s.m_next_poll.tv_sec &&
-				now.tv_nsec < s.m_next_poll.tv_nsec)) {
-				return DIDNT_POLL;
-			}
-		}
-		// send it real stuff
-		if(!s.empty()) {
-			blob msg = s.front();
-			flush_input();
-			writecook(s.addr(), s.txseq(), msg.size(), (const uint8_t *)msg.pvoid());
-			sendmsg = true;
-		}
-		else {
-			// Nothing else to say, plain poll.
-			unsigned char pollmsg[1];
-			pollmsg[0] = OSDP_POLL;
-			flush_input();
-			writecook(s.addr(), s.txseq(), sizeof(pollmsg), pollmsg);
-		}
+		unsigned addr;
+		const char *q = p;
+		if(!parse_number(&q, 3, &addr) || q != p + len || addr > 127)
+			return false;
+		t.addr = addr;
 	}
+	p += len;
 
-	int size = readcook();
-	// prepare to work the reply
-	if(size > 0) { // I rx okay, work seq
-		struct osdp_common_flex *omsg =
-			(struct osdp_common_flex *)m_in_buffer;
-		if((omsg->m.addr & 0x7F) != s.addr()) {
-			// Received from wrong address???
-			// Ignore.  Gah.
-			return DID_POLL;	// (but, I did poll.)
-		}
-		uint8_t seq = omsg->m.ctrl & 0x03;	// Get proto recvd sequence #
-		if(s.m_rxseq == 0 || seq == 0) {
-			s.m_rxseq = next_seq(seq);	// Determine next seq
-			// receipt okay, new sequence
-		}
-		else {
-			// OSDP document is not clear about the master's ("CP")
-			// behavior regarding the slave's ("PD") sequence numbers.
-			// If the CP does not hear a reply correctly, it asks again,
-			// with the same sequence number, which signals the PD to repeat
-			// the last message.  If the PD does not hear a poll correctly,
-			// the CP will poll it again (with the same seq).
-			// It does not explain behavior re the PD's receipt of CP
-			// sequence numbers.
-			// I'm going to behave as if they don't matter.
-		}
-		if(omsg->data[0] == OSDP_NAK ||
-			omsg->data[0] == OSDP_BUSY) {
-
-			if(omsg->data[0] == OSDP_NAK){
-				s.m_txseq = 0;
-			}
+	t.suffix = NULL;
+	if(*p == '/') {
+		t.suffix = p + 1;
+		if(*t.suffix == '\0')
+			return false;		// trailing slash
+	}
+	return true;
+}
 
-			s.m_rxseq = next_seq(seq);
-			return DID_POLL;		// not an ACK, but I polled
-		}
+// Does the MQTT payload say exactly this word?
+static bool payload_is(const struct mosquitto_message *message, const char *word) {
+	size_t len = strlen(word);
+	return (size_t)message->payloadlen == len &&
+		memcmp(message->payload, word, len) == 0;
+}
 
-		s.ack();		// I can xmit the next seq next time.
-		if(sendmsg)
-			s.pop();			// No rexmit
-
-		// Handle received messages here
-		if(omsg->data[0] != OSDP_ACK) { // (not the mundane stuff)
-			ostringstream topic;
-			topic << "osdp/bus1/incoming/" << (omsg->m.addr & 0x7F);
-			// The messages start from the func byte.
-			// SOH addr LSM MSB flag func
-			// [0] [1]  [2] [3] [4]  [5]
-			int mosqe =
-				mosquitto_publish(mq(), NULL, topic.str().c_str(),
-								  size-5, m_in_buffer + 5, 1, false);
-			mosq_errcheck(mosqe, "mosquitto_publish");
-			// Off it goes.
-		}
+// The suffix of a command topic: any of "durable", and a priority
+// class ("interactive", "normal" or "bulk"), separated by '/'.
+// Returns false if there's a word it doesn't know.
+static bool parse_delivery(const char *suffix, bool *durable, int *cls) {
+	static const char *classes[MSG_CLASSES] = {
+		"interactive", "normal", "bulk"
+	};
+	*durable = false;
+	*cls = -1;					// (by command code)
+	const char *p = suffix;
+	while(p && *p) {
+		const char *slash = strchr(p, '/');
+		size_t len = slash ? (size_t)(slash - p) : strlen(p);
+		int c;
+		for(c = 0; c < MSG_CLASSES; c++)
+			if(strlen(classes[c]) == len && strncmp(p, classes[c], len) == 0)
+				break;
+		if(c < MSG_CLASSES)
+			*cls = c;
+		else if(len == 7 && strncmp(p, "durable", len) == 0)
+			*durable = true;
+		else
+			return false;
+		p = slash ? slash + 1 : NULL;
 	}
-	else {
-		root.debug("** %d", size);
-		//root.info("readcook error %d", (int)size);
-		s.nak();				// Sorry, didn't succeed
-		// Handle errors, like timeout, for declaring modules STOPPED
-		if(size == PROTO_ERR_CRC)
-			katomic_inc(&m_crc_count);
-		else if(size == PROTO_ERR_TIMEOUT)
-			katomic_inc(&m_timeout_count);
-	}
-	return DID_POLL;
+	return true;
 }
 
-void message_for_slave(osdpslave &s, const std::vector<string> &components,
-					   const struct mosquitto_message *message) {
+void message_for_slave(osdpslave &s, const outgoing_topic &t,
+					   const struct mosquitto_message *message,
+					   const mosquitto_property *props) {
 	log4cpp::Category &root = log4cpp::Category::getRoot();
-	// What name to call this slave
-	char name[40];
-	snprintf(name, sizeof(name), "%d", s.addr());
-		
-	if(components.size() == 5 && components[4] == "control") {
+	bool durable;
+	int cls;
+
+	if(t.suffix && strcmp(t.suffix, "control") == 0) {
 		// The message is a command, right now only DISABLE and ENABLE supported
-		string cmd((const char *)message->payload, message->payloadlen);
-		root.info("%s %d", cmd.c_str(), name);
+		root.info("%.*s %d", message->payloadlen,
+				  (const char *)message->payload, (int)s.addr());
 
 		bool o = s.offline();	// What online state
-		if(cmd == "DISABLE")
+		if(payload_is(message, "DISABLE"))
 			s.enabled(false);
-		else if(cmd == "ENABLE") {
+		else if(payload_is(message, "ENABLE")) {
 			s.enabled(true);
 			o = true;			// When I'm enabling a slave, it's
 								// prior state was "offline"
 		}
 		s.declare_online(o);
 	}
+	else if(t.suffix && strncmp(t.suffix, "file", 4) == 0 &&
+			(t.suffix[4] == '\0' || t.suffix[4] == '/')) {
+		// A file to send it (file/<FtType>, or plain file for type 1)
+		int type = 1;
+		if(t.suffix[4] == '/')
+			type = strtol(t.suffix + 5, NULL, 0);
+		if(s.bus()->transfer_file(s, blob(message->payload, message->payloadlen),
+								  type))
+			root.info("File msg %ld to %d, %d bytes", (long)message->mid,
+					  (int)s.addr(), message->payloadlen);
+		else
+			root.warn("File msg %ld to %d refused (needs port.engine = "
+					  "coroutines)", (long)message->mid, (int)s.addr());
+	}
+	else if(!parse_delivery(t.suffix, &durable, &cls)) {
+		root.warn("Unknown topic %s ignored", message->topic);
+	}
 	else {
-		if(!s.enabled()) {
-			root.info("Message for disabled slave %s ignored", name);
+		// This messages queues to this slave.
+		osdpmsg msg(blob(message->payload, message->payloadlen));
+		if(props) {
+			// MQTT v5 request/response
+			char *topic = NULL;
+			void *corr = NULL;
+			uint16_t len = 0;
+			mosquitto_property_read_string(props, MQTT_PROP_RESPONSE_TOPIC,
+										   &topic, false);
+			mosquitto_property_read_binary(props, MQTT_PROP_CORRELATION_DATA,
+										   &corr, &len, false);
+			// (The reply has to fit a publisher slot, or it'd be lost)
+			const char *limit = NULL;
+			if(topic && strlen(topic) >= PUBLISHER_TOPIC_SIZE)
+				limit = "reply_to";
+			else if(corr && len > PUBLISHER_CORR_SIZE)
+				limit = "correlation";
+			if(topic)
+				msg.reply_to = topic;
+			if(corr)
+				msg.correlation = blob(corr, len);
+			free(topic);
+			free(corr);
+			if(limit) {
+				root.warn("Msg %ld to %d rejected: its %s is too long",
+						  (long)message->mid, (int)s.addr(), limit);
+				s.rejected();
+				s.bus()->transport()->rejected(s, limit, message->mid);
+				return;
+			}
+			clock_gettime(CLOCK_REALTIME, &msg.queued);
 		}
+		if(s.bus()->submit(s, msg, durable, cls, message->mid))
+			root.info("Delivered msg %ld to %d", (long)message->mid, (int)s.addr());
+	}
+}
+
+// Is it osdp/bus<n>/<name>?
+static bool parse_bus_topic(const char *topic, const char *name, unsigned *bus) {
+	static const char prefix[] = "osdp/bus";
+	const char *p = topic;
+	if(strncmp(p, prefix, sizeof(prefix)-1) != 0)
+		return false;
+	p += sizeof(prefix)-1;
+	if(!parse_number(&p, 3, bus))
+		return false;
+	return *p == '/' && strcmp(p + 1, name) == 0;
+}
+
+void message_v5_callback(struct mosquitto *mosq, void *obj,
+						 const struct mosquitto_message *message,
+						 const mosquitto_property *props) {
+	log4cpp::Category &root = log4cpp::Category::getRoot();
+	auto proto = *(busprotocol **)obj;
+
+	unsigned bus;
+	if(parse_bus_topic(message->topic, "credentials", &bus)) {
+		// Updates to the credential cache
+		if(bus != (unsigned)proto->busno() || proto->creds() == NULL)
+			root.warn("No credential cache for %s", message->topic);
 		else {
-			root.info("Delivered msg %ld to %s", (long)message->mid, name);
-			// This messages queues to this slave.
-			s.push(blob(message->payload, message->payloadlen));
+			int n = proto->creds()->update((const char *)message->payload,
+										   message->payloadlen);
+			root.info("credentials: %d updates, %zu cards", n,
+					  proto->creds()->size());
 		}
+		return;
 	}
+
+	if(parse_bus_topic(message->topic, "control", &bus)) {
+		// Commands for the whole bus; just DISCOVER so far
+		if(bus != (unsigned)proto->busno())
+			root.warn("Message for unknown bus %u ignored", bus);
+		else if(payload_is(message, "DISCOVER"))
+			proto->request_discover();
+		else
+			root.warn("Unknown bus command %.*s", message->payloadlen,
+					  (const char *)message->payload);
+		return;
+	}
+
+	if(proto->monitoring()) {
+		root.warn("Monitoring only; %s ignored", message->topic);
+		return;
+	}
+
+	outgoing_topic t;
+	if(!parse_outgoing(message->topic, t)) {
+		root.warn("Malformed topic %s ignored", message->topic);
+		return;
+	}
+	if(t.bus != (unsigned)proto->busno()) {
+		root.warn("Message for unknown bus %u ignored", t.bus);
+		return;
+	}
+
+	osdpslave *s;
+	if(t.addr >= 0)
+		s = proto->find_slave((uint8_t)t.addr);
+	else
+		s = proto->find_slave(t.uuid);
+	if(s == NULL) {
+		root.info("No slave for topic %s", message->topic);
+		return;
+	}
+	message_for_slave(*s, t, message, props);
 }
 
 void message_callback(struct mosquitto *mosq, void *obj,
 					  const struct mosquitto_message *message) {
-	// Pick apart the topic
-	auto proto = *(busprotocol **)obj;
-	vector<string> components;
-	split(string(message->topic), components, '/');
-	// [0] = osdp
-	// [1] = bus%d (should be 1)
-	// [2] = outgoing
-	// [3] = OSDP address
-	// [4] = "control", if components.size() == 5
-
-	assert(components[0] == "osdp");
-	assert(components[1] == "bus1");
-	assert(components[2] == "outgoing");
-	unsigned long addr = strtoul(components[3].c_str(), NULL, 10);
-	for(auto i = proto->m_slaves.begin(); i != proto->m_slaves.end(); i++) {
-		osdpslave &s = *i;
-		if(s.addr() == addr) {
-			message_for_slave(s, components, message);
-			return;
-		}
-	}
+	message_v5_callback(mosq, obj, message, NULL);
 }
 
 void log_callback(struct mosquitto *mq, void *user, int level, const char *msg) {
@@ -421,6 +492,7 @@ void log_callback(struct mosquitto *mq, void *user, int level, const char *msg)
 int main(int argc, char *argv[]) {
 	struct serial_config config;
 	busprotocol *proto;
+	publisher *pub;
 	int frombaud = -1;
 	memset(&config, 0, sizeof(config));
 
@@ -504,7 +576,16 @@ int main(int argc, char *argv[]) {
 		mosquitto_new("osdpmaster", false, (void *)&proto);
 
 	// Give me a call when a message arrives
-	mosquitto_message_callback_set(mosq, message_callback);
+	bool v5 = g_config.get<bool>("mqtt.v5", false);
+	if(v5) {
+		// (for request/response properties)
+		mosqe = mosquitto_int_option(mosq, MOSQ_OPT_PROTOCOL_VERSION,
+									 MQTT_PROTOCOL_V5);
+		mosq_errcheck(mosqe, "mosquitto_int_option");
+		mosquitto_message_v5_callback_set(mosq, message_v5_callback);
+	}
+	else
+		mosquitto_message_callback_set(mosq, message_callback);
 
 	if(mqtt_user != "")
 		mosquitto_username_pw_set(mosq, mqtt_user.c_str(), mqtt_password.c_str());
@@ -513,6 +594,8 @@ int main(int argc, char *argv[]) {
 	mosq_errcheck(mosqe, "mosquitto_connect");
 	mosqe = mosquitto_subscribe(mosq, NULL, "osdp/bus1/outgoing/#", 0);
 	mosq_errcheck(mosqe, "mosquitto_subscribe");
+	mosqe = mosquitto_subscribe(mosq, NULL, "osdp/bus1/control", 0);
+	mosq_errcheck(mosqe, "mosquitto_subscribe");
 
 	{
 		// Find the [port] settings
@@ -533,9 +616,57 @@ int main(int argc, char *argv[]) {
 		xparse_config(config, &port2);
 		proto = new busprotocol(&config);
 		proto->port2(port2);
+		proto->m_discover_timeout =
+			g_config.get<long>("port.discover_timeout", 20000);
+		proto->m_probe_share = g_config.get<double>("port.probe_share", 0.1);
+		proto->m_probe_timeout =
+			g_config.get<long>("port.probe_timeout",
+							   std::min(config.timeout, 20000L));
+		proto->m_probe_interval =
+			g_config.get<long>("port.probe_interval", 5) * 1000;
+		proto->m_probe_max = g_config.get<long>("port.probe_max", 60) * 1000;
+		if(g_config.get<bool>("port.discover", false))
+			proto->request_discover();
+		proto->m_monitor = g_config.get<bool>("port.monitor", false);
+		proto->m_monitor_all = g_config.get<bool>("port.monitor_all", false);
+		proto->m_monitor_interval = g_config.get<int>("port.monitor_interval", 10);
+		proto->m_max_msgs = g_config.get<size_t>("port.max_msgs", 0);
+		proto->m_max_bytes = g_config.get<size_t>("port.max_bytes", 0);
+		string policy = g_config.get<string>("port.queue_policy", "reject");
+		proto->m_policy = queue_policy(policy.c_str());
+		if(proto->m_policy == QUEUE_ADMIT) {
+			root.error("port: unknown queue_policy %s", policy.c_str());
+			proto->m_policy = QUEUE_REJECT;
+		}
+		proto->m_stats_interval = g_config.get<int>("mqtt.stats_interval", 60);
+		proto->m_hot_window = g_config.get<long>("port.card_window", 250);
+		proto->m_latency_check = g_config.get<int>("port.latency_check", 0);
+		proto->m_failover_timeouts =
+			g_config.get<int>("port.failover_timeouts", 0);
+		proto->m_standby_check = g_config.get<long>("port.standby_check", 1000);
+		string engine = g_config.get<string>("port.engine", "threads");
+		if(engine == "coroutines")
+			proto->m_coroutines = !proto->m_monitor; // (monitor mode
+													 // has no turns)
+		else if(engine != "threads")
+			root.error("port: unknown engine %s", engine.c_str());
+		proto->m_file_fragment =
+			g_config.get<int>("port.file_fragment", 128);
 	}
 
-	proto->m_mq = mosq;
+	{
+		// The publisher thread does all my mosquitto_publish calls
+		pub = new publisher(mosq);
+		pub->qos(PUB_REPLY, g_config.get<int>("mqtt.qos_reply", 1));
+		pub->qos(PUB_STATUS, g_config.get<int>("mqtt.qos_status", 1));
+		pub->qos(PUB_STATS, g_config.get<int>("mqtt.qos_stats", 0));
+		pub->v5(v5);
+		pub->decode(g_config.get<bool>("mqtt.decode", false));
+		pub->qos(PUB_CARD, g_config.get<int>("mqtt.qos_card", 1));
+		pub->stats(g_config.get<int>("mqtt.stats_interval", 60),
+				   "osdpiom/publisher/stats");
+		proto->m_transport = new mqtttransport(pub, proto->busno());
+	}
 
 	{
 		// Find the <slave> elements
@@ -548,13 +679,126 @@ int main(int argc, char *argv[]) {
 					addr = (*xaddr).c_str();
 
 				osdpslave &s = proto->add_slave(addr);
+
+				auto xuuid =
+					g_config.get_optional<string>(i_sect.first + ".uuid");
+				if (xuuid) {
+					uuid_t u;
+					if (uuid_parse((*xuuid).c_str(), u) != 0)
+						root.error("%s: bad uuid %s", i_sect.first.c_str(),
+								   (*xuuid).c_str());
+					else {
+						s.set_uuid(u);
+						if (!xaddr)
+							proto->request_discover(); // go find it
+					}
+				}
+
+				// Replies to publish only when they change
+				string quiet =
+					g_config.get<string>(i_sect.first + ".change_only", "");
+				vector<string> codes;
+				split(quiet, codes, ' ');
+				for(auto i_code = codes.begin(); i_code != codes.end(); i_code++) {
+					if(i_code->empty())
+						continue;
+					int code = osdp_reply_code(i_code->c_str());
+					if(code < 0)
+						root.error("%s: unknown reply %s", i_sect.first.c_str(),
+								   i_code->c_str());
+					else
+						s.change_only(code);
+				}
+				s.refresh(g_config.get<int>(i_sect.first + ".refresh", 60));
+				s.starve(g_config.get<int>(i_sect.first + ".starve", 8));
+
+				// Its answers to cards the credential cache knows
+				if(!s.decision(g_config.get<string>(i_sect.first + ".grant", ""),
+							   g_config.get<string>(i_sect.first + ".deny", "")))
+					root.error("%s: grant/deny commands must be hex",
+							   i_sect.first.c_str());
+
+				// Backpressure
+				string policy =
+					g_config.get<string>(i_sect.first + ".queue_policy", "reject");
+				qpolicy_t qp = queue_policy(policy.c_str());
+				if(qp == QUEUE_ADMIT) {
+					root.error("%s: unknown queue_policy %s",
+							   i_sect.first.c_str(), policy.c_str());
+					qp = QUEUE_REJECT;
+				}
+				s.limits(g_config.get<size_t>(i_sect.first + ".max_msgs", 256),
+						 g_config.get<size_t>(i_sect.first + ".max_bytes", 0),
+						 qp, g_config.get<long>(i_sect.first + ".max_latency", 0));
+
 				s.declare_online(false); // slaves are born offline
 			}
 		}
 	}
 
+	{
+		// Durable commands, if there's a [journal]
+		auto xfile = g_config.get_optional<string>("journal.file");
+		if(xfile) {
+			journal *j = new journal;
+			if(!j->open((*xfile).c_str(),
+						g_config.get<size_t>("journal.size", 1048576),
+						g_config.get<int>("journal.sync_ms", 100)))
+				exit(1);
+			proto->m_journal = j;
+
+			// Replay what the PDs never ACKed
+			std::vector<journal::entry> live;
+			j->take_live(live);
+			for(auto i = live.begin(); i != live.end(); i++) {
+				osdpslave *s = NULL;
+				if(!mem_zero(i->uuid, sizeof(uuid_t)))
+					s = proto->find_slave(i->uuid);
+				if(s == NULL && i->addr < 0x7F)
+					s = proto->find_slave(i->addr);
+				if(s == NULL) {
+					root.warn("Journal: no slave %d for a durable msg; dropped",
+							  (int)i->addr);
+					j->done(i->id);
+				}
+				else
+					s->push(osdpmsg(i->data, i->id));
+			}
+			if(!live.empty())
+				root.info("Journal: replayed %zu msgs", live.size());
+		}
+	}
+
+	{
+		// Local card decisions, if there's a [credentials] cache
+		auto xcapacity = g_config.get_optional<size_t>("credentials.capacity");
+		if(xcapacity) {
+			proto->m_creds = new credcache(*xcapacity);
+			mosqe = mosquitto_subscribe(mosq, NULL, "osdp/bus1/credentials", 1);
+			mosq_errcheck(mosqe, "mosquitto_subscribe");
+		}
+	}
+
+	{
+		// Shared-memory rings for local clients
+		if(g_config.get<bool>("port.shm", false)) {
+			shmtransport *shm = new shmtransport;
+			if(!shm->open(proto->busno()))
+				exit(1);
+			proto->m_shm = shm;
+		}
+	}
+
+	pub->start();
+
 	pthread_t th;
-	pthread_create(&th, NULL, busprotocol_run, (void *)proto);
+	if(proto->m_coroutines) {
+		busloop *loop = new busloop;
+		loop->spawn(proto->co_run(*loop));
+		pthread_create(&th, NULL, busloop_run, (void *)loop);
+	}
+	else
+		pthread_create(&th, NULL, busprotocol_run, (void *)proto);
 
 	mosqe = mosquitto_loop_forever(mosq, -1, 1); // This is where main() lives
 	mosq_errcheck(mosqe, "mosquitto_loop_forever");
@@ -1,96 +1,68 @@
 #ifndef OSDPMASTER_H
 #define OSDPMASTER_H
 
-#include <iomanip>
-#include <sstream>
 #include <mosquitto.h>
-#include "log4cpp.h"
 
-#include "osdpprotocol.h"
+#include <unordered_map>
 
-class logprotocol: public protocol {
-public:
-	logprotocol(struct serial_config *config)
-		: protocol(config) {
-	}
-
-	virtual ~logprotocol() {
-	}
+#include "busprotocol.h"
+#include "publisher.h"
 
+// osdpmaster's transport: whatever the bus says goes out over MQTT,
+// by way of the publisher thread.
+class mqtttransport: public transport {
 protected:
-	static void datalog(const char *prefix, const uint8_t *buffer, int len);
-
-	virtual void xlog(const uint8_t *buffer, int len) {
-		datalog("TX", buffer, len);
-	}
-
-	virtual void rlog(const uint8_t *buffer, int len) {
-		datalog("RX", buffer, len);
-	}
+	publisher *m_pub;
+	int m_busno;				// I publish under "osdp[iom]/bus<n>"
+
+	// A slave's topics, rendered when I first hear of it and again
+	// whenever its address or UUID changes, so that publishing a card
+	// read never has to build one.  (Only the bus thread uses these:
+	// status and errors, which the MQTT thread also sends, aren't
+	// cached.)
+	struct slave_topics {
+		uint8_t addr;			// what they were rendered for
+		uuid_t uuid;
+		char incoming[PUBLISHER_TOPIC_SIZE];
+		char card[PUBLISHER_TOPIC_SIZE];		// (RAW & FMT, fast lane)
+		char keypad[PUBLISHER_TOPIC_SIZE];	// (KEYPAD, fast lane)
+		char access[PUBLISHER_TOPIC_SIZE];	// (local decisions)
+		char stats[PUBLISHER_TOPIC_SIZE];
+		char file[PUBLISHER_TOPIC_SIZE];		// (file transfer results)
+	};
+	std::unordered_map<const osdpslave *, slave_topics> m_topics;
+
+	const slave_topics &topics(const osdpslave &s);
+	// "osdpiom/bus<n>/incoming/<s>/<what>", where s is named by its
+	// UUID if it has one, else its address
+	void slave_topic(const osdpslave &s, const char *what,
+					 char *topic, size_t size) const;
 
-};
-
-class busprotocol: public logprotocol {
 public:
-	typedef std::list<osdpslave> slavelist_t;
-	slavelist_t m_slaves; 	// here I instantiate the slaves I address
-	slavelist_t::iterator m_poll_slave;
-
-	// The queue for BUS messages
-	blobqueue_t m_msglist;
-
-	katomic_t m_crc_count;
-	katomic_t m_timeout_count;
-
-	struct mosquitto *m_mq;		// where outgoing messages can be
-								// posted
-
-	const char *m_port2;		// Alternate port name
-
-public:
-	busprotocol(struct serial_config *config)
-		: logprotocol(config),
-		m_crc_count(0), m_timeout_count(0) {
-		m_poll_slave = m_slaves.end();
-		m_port2 = NULL;
-	}
-
-	virtual ~busprotocol() {
-	}
-
-	osdpslave &add_slave(const char *addr);
-
-	inline bool empty() {
-		return m_msglist.empty();
-	}
-	inline blob front() {
-		return m_msglist.front();
-	}
-	inline void pop() {
-		m_msglist.pop();
+	mqtttransport(publisher *pub, int busno)
+		: m_pub(pub), m_busno(busno) {
 	}
 
-	inline void push(blob msg) {
-		m_msglist.push(msg);
+	virtual ~mqtttransport() {
 	}
 
-	void init();
-	void run();
-
-	typedef enum {
-		DID_POLL, DIDNT_POLL
-	} polled_t;
-	polled_t slave_poll(void);
-
-	bool id_slave(const uuid_t uuid);
-
-	inline struct mosquitto *mq(void) { return m_mq; }
-
-	inline const char *port2(void) const { return m_port2; }
-	inline const char *port2(const char *n) { const char *t = m_port2; m_port2 = n; return t; }
+	virtual void reply(osdpslave &s, const uint8_t *reply, int len);
+	virtual void card(osdpslave &s, const uint8_t *reply, int len);
+	virtual void answer(osdpslave &s, const osdpmsg &request,
+						const uint8_t *reply, int len);
+	virtual void status(osdpslave &s, const char *status);
+	virtual void decided(osdpslave &s, const uint8_t *card, int len,
+						 bool grant);
+	virtual void rejected(osdpslave &s, const char *limit, long mid);
+	virtual void monitored(uint8_t addr, bool pd,
+						   const uint8_t *frame, int len);
+	virtual void discovered(int addr, const char *json, int len);
+	virtual void report(const char *kind, int addr,
+						const char *json, int len);
+	virtual void report(osdpslave &s, const char *kind,
+						const char *json, int len);
+
+	inline publisher *pub(void) { return m_pub; }
 };
 
-void mosq_errcheck(int mosqe, const char *context);
-
-
 #endif // OSDPMASTER_H
@@ -8,31 +8,20 @@
 #include <termios.h>
 #include <sys/poll.h>
 #include <pthread.h>
+#include <limits.h>
+#include <stdlib.h>
+
+#include <algorithm>
 
 #include "log4cpp.h"
 
 #include "crc16.h"
+#include "timespec.h"
 
 #include "osdpprotocol.h"
 
 using namespace std;
 
-bool operator<(const struct timespec &left, const struct timespec &right) {
-	if(left.tv_sec < right.tv_sec)
-		return true;
-	if(left.tv_sec > right.tv_sec)
-		return false;
-	return left.tv_nsec < right.tv_nsec;
-}
-
-bool operator<=(const struct timespec &left, const struct timespec &right) {
-	if(left.tv_sec < right.tv_sec)
-		return true;
-	if(left.tv_sec > right.tv_sec)
-		return false;
-	return left.tv_nsec <= right.tv_nsec;
-}
-
 std::ostream &operator<<(std::ostream &out, struct timespec &ts) {
 	out << "{" <<
 		ts.tv_sec << ":" <<
@@ -42,8 +31,24 @@ std::ostream &operator<<(std::ostream &out, struct timespec &ts) {
 
 protocol::protocol(const struct serial_config *config) {
 	m_my_addr = 0xFF;	// I'm a master, I see all addresses
+	m_fd = m_fd2 = -1;
+	m_port2 = NULL;
 	m_out_len = 0;
+	m_out_iovcnt = 0;
 	memset(&m_next_write, 0, sizeof(m_next_write));
+	memset(&m_tx_start, 0, sizeof(m_tx_start));
+	m_tx_bytes = 0;
+	memset(&m_tx_end, 0, sizeof(m_tx_end));
+	m_echo_iovcnt = 0;
+	m_echo_len = m_echo_at = 0;
+	m_echoed = 0;
+	m_keep_long = false;
+	m_long_size = 0;
+	m_delayed_us = 0;
+	m_usb.latency_path[0] = '\0';
+	m_usb.latency_saved = -1;
+	m_usb.low_latency = false;
+	m_usb2 = m_usb;
 	m_config.baud = 115200;
 	m_config.parity = 'N';
 	m_config.bits = 8;
@@ -53,8 +58,32 @@ protocol::protocol(const struct serial_config *config) {
 	m_config.timeout = 3000;	// 3000us default timeout
 	m_config.delay = 600;		// 600us after receipt before xmit
 	m_config.idle = 30;			// 3000us idle timer
+	m_config.latency_timer = 0;
+	m_config.echo_cancel = 0;
 	if(config)
 		m_config = *config;
+
+	build_frame_cache();
+}
+
+// A number in a sysfs file, or -1
+static int read_sysfs(const char *path) {
+	FILE *f = fopen(path, "r");
+	if(f == NULL)
+		return -1;
+	int n = -1;
+	if(fscanf(f, "%d", &n) != 1)
+		n = -1;
+	fclose(f);
+	return n;
+}
+
+static bool write_sysfs(const char *path, int n) {
+	FILE *f = fopen(path, "w");
+	if(f == NULL)
+		return false;
+	bool ok = fprintf(f, "%d\n", n) > 0;
+	return fclose(f) == 0 && ok;
 }
 
 int protocol::prepcom(void) {
@@ -228,6 +257,35 @@ int protocol::prepcom(void) {
 			throw protocol_exception("Failed to set RS485 parameters");
 	}
 
+	else {
+		// USB-serial adapters hold received bytes for up to their
+		// latency timer (FTDI's is 16ms out of the box) before passing
+		// them on.  That's longer than a whole exchange should take.
+		char real[PATH_MAX], path[sizeof(m_usb.latency_path)];
+		path[0] = '\0';
+		if(m_config.latency_timer > 0 && realpath(m_config.port, real)) {
+			const char *name = strrchr(real, '/');
+			if(snprintf(path, sizeof(path),
+						"/sys/class/tty/%s/device/latency_timer",
+						name ? name + 1 : real) >= (int)sizeof(path))
+				path[0] = '\0';	// (no tty has a name that long; don't guess)
+		}
+		if(strcmp(path, m_usb.latency_path) != 0) {
+			// (A new adapter; reopening the same one, I'd only see
+			// what I set it to before)
+			strcpy(m_usb.latency_path, path);
+			m_usb.latency_saved = path[0] ? read_sysfs(path) : -1;
+			if(m_usb.latency_saved < 0)
+				m_usb.latency_path[0] = '\0'; // (not that kind of adapter)
+		}
+		low_latency(true);
+
+		log4cpp::Category &root = log4cpp::Category::getRoot();
+		char text[128];
+		usb_report(text, sizeof(text));
+		root.info("%s: %s", m_config.port, text);
+	}
+
 	i = tcflush(m_fd, TCIOFLUSH);	// flush out any buffered bytes
 	if(i < 0)
 		throw protocol_exception("Failed to flush FIFO buffers");
@@ -237,6 +295,43 @@ int protocol::prepcom(void) {
     return 0;	// Done
 }
 
+bool protocol::low_latency(bool on) {
+	log4cpp::Category &root = log4cpp::Category::getRoot();
+	bool tuned = false;
+
+	// Tell the tty layer to push bytes up as they come
+	struct serial_struct ss;
+	if(ioctl(m_fd, TIOCGSERIAL, &ss) == 0) {
+		if(on)
+			ss.flags |= ASYNC_LOW_LATENCY;
+		else
+			ss.flags &= ~ASYNC_LOW_LATENCY;
+		if(ioctl(m_fd, TIOCSSERIAL, &ss) == 0)
+			tuned = true;
+		if(ioctl(m_fd, TIOCGSERIAL, &ss) == 0)
+			m_usb.low_latency = (ss.flags & ASYNC_LOW_LATENCY) != 0;
+	}
+
+	// ...and the adapter to send them sooner
+	if(m_usb.latency_path[0]) {
+		int ms = on ? m_config.latency_timer : m_usb.latency_saved;
+		if(write_sysfs(m_usb.latency_path, ms))
+			tuned = true;
+		else if(on)
+			root.warn("%s: can't set %s to %d (permissions?)",
+					  m_config.port, m_usb.latency_path, ms);
+	}
+	return tuned;
+}
+
+int protocol::usb_report(char *text, size_t size) {
+	int ms = m_usb.latency_path[0] ? read_sysfs(m_usb.latency_path) : -1;
+	return snprintf(text, size,
+					"{\"latency_timer_ms\":%d,\"was_ms\":%d,"
+					"\"low_latency\":%s}",
+					ms, m_usb.latency_saved, m_usb.low_latency ? "true" : "false");
+}
+
 protocol::~protocol() {
 	close();					// call self-closer.
 }
@@ -247,6 +342,58 @@ void protocol::close(void) {
 	m_fd = -1;
 }
 
+void protocol::swap_ports(void) {
+	std::swap(m_fd, m_fd2);
+	std::swap(m_config.port, m_port2);
+	std::swap(m_usb, m_usb2);
+	m_echo_len = 0;				// (nothing sent on this one yet)
+}
+
+bool protocol::open_standby(void) {
+	if(m_port2 == NULL)
+		return false;
+	close_standby();
+	swap_ports();
+	bool ok = try_prepcom();
+	swap_ports();
+	return ok;
+}
+
+bool protocol::try_prepcom(void) {
+	try {
+		prepcom();
+		return true;
+	}
+	catch(protocol_exception &e) {
+		close();
+		return false;
+	}
+}
+
+bool protocol::standby_ok(void) {
+	if(m_fd2 < 0)
+		return false;
+	// Unplugged?
+	struct pollfd fds[1];
+	fds[0].fd = m_fd2;
+	fds[0].events = POLLIN;
+	fds[0].revents = 0;
+	if(poll(fds, 1, 0) > 0 && (fds[0].revents & (POLLERR|POLLHUP|POLLNVAL)))
+		return false;
+	struct termios dcb;
+	if(tcgetattr(m_fd2, &dcb) < 0)
+		return false;
+	// It hears the bus too; don't let that pile up for when I switch
+	tcflush(m_fd2, TCIFLUSH);
+	return true;
+}
+
+void protocol::close_standby(void) {
+	if(m_fd2 != -1)
+		::close(m_fd2);
+	m_fd2 = -1;
+}
+
 int protocol::read_some(int offset, int count) {
 	for(;;) {
 		memo("read...");
@@ -292,7 +439,14 @@ int protocol::read_some(int offset, int count) {
 
 			throw protocol_exception("read I/O error");
 		}
+		if(size == 0)			// (no data is EAGAIN: this is a hangup)
+			throw protocol_exception("read hung up");
 		rlog(m_in_buffer+offset, size);
+		if(size > 0 && m_echo_at < m_echo_len) {
+			size = skip_echo(m_in_buffer+offset, size);
+			if(size == 0)
+				continue;		// (it was all mine)
+		}
 		return offset+size;		// How much buffer is occupied now
 	}
 	/*NOTREACHED*/
@@ -300,6 +454,47 @@ int protocol::read_some(int offset, int count) {
 	throw protocol_exception("read I/O error");
 }
 
+uint8_t protocol::echo_byte(int at) const {
+	for(int n = 0; n < m_echo_iovcnt; n++) {
+		if((size_t)at < m_echo_iov[n].iov_len)
+			return ((const uint8_t *)m_echo_iov[n].iov_base)[at];
+		at -= m_echo_iov[n].iov_len;
+	}
+	return 0;
+}
+
+int protocol::skip_echo(uint8_t *buffer, int size) {
+	// Drop what matches the frame I just sent; return what's left.
+	int i = 0;
+	while(i < size && m_echo_at < m_echo_len &&
+		  buffer[i] == echo_byte(m_echo_at)) {
+		i++;
+		m_echo_at++;
+	}
+
+	bool soh = false;
+	if(m_echo_at == m_echo_len) {
+		if(m_echoed++ == 0) {
+			log4cpp::Category &root = log4cpp::Category::getRoot();
+			root.warn("%s echoes what I send (I'll skip it)", m_config.port);
+		}
+		m_echo_len = 0;
+	}
+	else if(i < size) {
+		// Not my echo after all.  My frame and a reply start alike
+		// (sync bytes, SOH) and differ at the address, so if that's
+		// where it stopped matching, the SOH was the PD's.  (It came
+		// in this call: I keep reading while it's all matching.)
+		soh = m_echo_at == m_config.lead + 1;
+		m_echo_len = 0;
+	}
+	size -= i;
+	memmove(buffer + soh, buffer + i, size);
+	if(soh)
+		buffer[0] = chSOH;
+	return size + soh;
+}
+
 int protocol::readsoh() {
 	// Skip received characters until SOH
 	// read four leading message bytes (SOH addr len-LSB len-MSB)
@@ -397,6 +592,55 @@ int protocol::flyby(int offset) {
 	return PROTO_ERR_FLYBY;	// flyby success.
 }
 
+int protocol::readlong(int offset) {
+	// Keep what fits, and check the rest as it passes, as flyby()
+	// does: the frame's start is returned, the rest of it's counted.
+	struct osdp_common *hdr = (struct osdp_common *)m_in_buffer;
+	int total = hdr->len[0] | (hdr->len[1] << 8);
+	int check = (hdr->ctrl & 0x04) ? 2 : 1; // CRC, or checksum
+	int body = total - check;
+	const int keep = sizeof(m_in_buffer) - 32; // (the rest, to read past)
+	while(offset < keep) {
+		offset = read_some(offset, keep - offset);
+		if(offset < 0)
+			return offset;
+	}
+
+	uint16_t crc;
+	uint8_t checksum = 0;
+	crc16_prepare(crc);
+	const uint8_t *piece = m_in_buffer;
+	int n = keep, seen = 0;
+	for(;;) {
+		if(check == 2)
+			crc = crc16_add(crc, piece, n);
+		else
+			for(int i = 0; i < n; i++)
+				checksum += piece[i];
+		if((seen += n) >= body)
+			break;
+		// The next piece goes after what I'm keeping
+		n = read_some(keep, std::min(body - seen, 32));
+		if(n < 0)
+			return n;
+		n -= keep;
+		piece = m_in_buffer + keep;
+	}
+
+	offset = keep;
+	while(offset < keep + check) {
+		offset = read_some(offset, keep + check - offset);
+		if(offset < 0)
+			return offset;
+	}
+	if(check == 2 ? crc16_digest(crc) != (m_in_buffer[keep] |
+										  (m_in_buffer[keep + 1] << 8))
+	   : checksum != m_in_buffer[keep])
+		return PROTO_ERR_CRC;
+	m_long_size = total;
+	return keep;
+}
+
 int protocol::readeof(int offset) {
 	// readsoh provided the first 4 bytes: SOH, addr, len.
 	// Now read the full message indicated by count, or timeout.
@@ -428,29 +672,124 @@ void protocol::readstamp(void) {
 	}
 }
 
-void protocol::delaywait(void) {
+bool protocol::holdoff(void) {
 	if(m_next_write.tv_sec == 0 && m_next_write.tv_nsec == 0)
 		readstamp();			// Don't know when the last read was
 
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if(now < m_next_write) {
+		struct timespec wait = m_next_write - now;
+		m_delayed_us += wait.tv_sec * 1000000 + wait.tv_nsec / 1000;
+		return true;
+	}
+	return false;
+}
+
+void protocol::delaywait(void) {
 	// one simple API sleeps until the monotonic time is reached.
-	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &m_next_write, NULL);
+	if(holdoff())
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &m_next_write, NULL);
 }
 
-int protocol::readcook(void) {
-	log4cpp::Category &root=log4cpp::Category::getRoot();
+void protocol::read_deadline(void) {
+	// The PD can't start answering before my frame's all out, so the
+	// timeout only has to cover its turnaround
 	clock_gettime(CLOCK_MONOTONIC, &m_deadline);
-	auto qr = div((long)m_config.timeout, (long)1000000);
-	m_deadline.tv_sec += qr.quot;
-	m_deadline.tv_nsec += qr.rem * 1000;
-	if(m_deadline.tv_nsec >= 1000000000) {
-		m_deadline.tv_nsec -= 1000000000;
-		m_deadline.tv_sec += 1;
+	if(m_deadline < m_tx_end)
+		m_deadline = m_tx_end;
+	add_us(m_deadline, m_config.timeout);
+}
+
+int protocol::read_frame(int &have) {
+	// Everything readcook() does (but fly-bys: I'm a master), without
+	// waiting: take what's come so far, and say 0 if that's not all.
+	struct osdp_common *hdr = (struct osdp_common *)m_in_buffer;
+	for(;;) {
+		int want = (int)sizeof(struct osdp_common) - have;
+		if(want <= 0) {
+			int total = hdr->len[0] | (hdr->len[1] << 8);
+			if(total <= 5 || total > (int)sizeof(m_in_buffer)) {
+				have = 0;
+				return PROTO_ERR_OVERFLOW;
+			}
+			if(have >= total)
+				return check_frame(total);
+			want = total - have;
+		}
+
+		int size = ::read(m_fd, m_in_buffer + have, want);
+		if(size < 0) {
+			if(errno == EINTR)
+				continue;
+			if(errno == EWOULDBLOCK || errno == EAGAIN)
+				return 0;		// (more to come)
+			throw protocol_exception("read I/O error");
+		}
+		if(size == 0)			// (no data is EAGAIN: this is a hangup)
+			throw protocol_exception("read hung up");
+		rlog(m_in_buffer + have, size);
+		if(m_echo_at < m_echo_len &&
+		   (size = skip_echo(m_in_buffer + have, size)) == 0)
+			continue;			// (it was all mine)
+		have += size;
+
+		if(have <= (int)sizeof(struct osdp_common)) {
+			// Skip received characters until SOH
+			uint8_t *soh = (uint8_t *)memchr(m_in_buffer, chSOH, have);
+			if(soh == NULL)
+				have = 0;
+			else if(soh > m_in_buffer) {
+				have -= soh - m_in_buffer;
+				memmove(m_in_buffer, soh, have);
+			}
+		}
 	}
+}
+
+int protocol::check_frame(int size) {
+	// integrity check...
+	// OSDP ctrl flag says whether checksum or CRC16 was supplied.
+	struct osdp_common *hdr =
+			(struct osdp_common *)m_in_buffer;
+
+	if(hdr->ctrl & 0x04) {
+		uint16_t crc, mycrc;
+		crc16_prepare(crc);
+		crc = crc16_add(crc, m_in_buffer, size-2);
+		mycrc = crc16_digest(crc);
+		uint16_t msgcrc = m_in_buffer[size-2] |
+			(m_in_buffer[size-1] << 8);
+		if(msgcrc != mycrc)
+			return PROTO_ERR_CRC;
+		return size-2;			// size minus checksum
+	}
+	else {
+		uint8_t csum = 0, *mptr = m_in_buffer, *end=m_in_buffer + size - 1;
+		while(mptr < end)
+			csum += *mptr++;
+		if(csum != m_in_buffer[size-1])
+			return PROTO_ERR_CRC;
+		return size-1;
+	}
+}
 
+int protocol::readcook(void) {
+	log4cpp::Category &root=log4cpp::Category::getRoot();
+	read_deadline();
+
+	m_long_size = 0;
 	int size2 = 0, size = readsoh();
 	if(size < 0) {
 		goto leave;
 	}
+	if(m_keep_long) {
+		struct osdp_common *hdr = (struct osdp_common *)m_in_buffer;
+		if((hdr->len[0] | (hdr->len[1] << 8)) > (int)sizeof(m_in_buffer) - size) {
+			size = readlong(size);
+			goto leave;
+		}
+	}
 	if(m_my_addr != 0xFF) { // If I'm a master, I see all
 		struct osdp_common *hdr = (struct osdp_common *)m_in_buffer;
 		if(hdr->addr != m_my_addr &&
@@ -466,44 +805,22 @@ int protocol::readcook(void) {
 		size = size2;			// Tell caller of I/O error
 		goto leave;
 	}
-	size = size2;
-
-	{
-		// integrity check...
-		// OSDP ctrl flag says whether checksum or CRC16 was supplied.
-		struct osdp_common *hdr =
-				(struct osdp_common *)m_in_buffer;
-
-		if(hdr->ctrl & 0x04) {
-			uint16_t crc, mycrc;
-			crc16_prepare(crc);
-			crc = crc16_add(crc, m_in_buffer, size-2);
-			mycrc = crc16_digest(crc);
-			uint16_t msgcrc = m_in_buffer[size-2] |
-				(m_in_buffer[size-1] << 8);
-			if(msgcrc != mycrc) {
-				size = PROTO_ERR_CRC;
-				goto leave;
-			}
-			size = size-2;			// size minus checksum
-		}
-		else {
-			uint8_t csum = 0, *mptr = m_in_buffer, *end=m_in_buffer + size - 1;
-			while(mptr < end)
-				csum += *mptr++;
-			if(csum != m_in_buffer[size-1]) {
-				size = PROTO_ERR_CRC;
-				goto leave;
-			}
-			size -= 1;
-		}
-	}
+	size = check_frame(size2);
 
 leave:
 	readstamp();				// Set m_next_time
 	return size;				// size minus checksum
 }
 
+long protocol::wire_us(int bytes) const {
+	// Every character is a start bit, data bits, maybe a parity
+	// bit, and stop bits.
+	int bits = 1 + m_config.bits + m_config.stop;
+	if(m_config.parity != 'n' && m_config.parity != 'N')
+		bits++;
+	return (long)((long long)bytes * bits * 1000000 / m_config.baud);
+}
+
 void protocol::flush_input(void) {
 	int i = tcflush(m_fd, TCIFLUSH);	// flush out any waiting input
 	if(i < 0)
@@ -543,7 +860,57 @@ int protocol::waitidle(void) {
 void protocol::readreset(void) {
 }
 
-int protocol::writecook(int addr, int seq, int size, const uint8_t *payload) {
+// Commands with a payload that never changes.  Each gets an encoded
+// frame per address and sequence number in m_frame_cache.
+static const struct {
+	uint8_t size;
+	uint8_t payload[2];
+} fixed_commands[] = {
+	{ 1, { OSDP_POLL } },
+	{ 2, { OSDP_ID, 0x00 } },	// (0 = "send standard PDID")
+	{ 2, { OSDP_CAP, 0x00 } },
+	{ 1, { OSDP_LSTAT } },
+	{ 1, { OSDP_ISTAT } },
+	{ 1, { OSDP_OSTAT } },
+	{ 1, { OSDP_RSTAT } },
+};
+#define FIXED_COMMANDS (sizeof(fixed_commands)/sizeof(fixed_commands[0]))
+
+void protocol::build_frame_cache(void) {
+	m_frame_cache.clear();
+	if(m_config.lead + m_config.trail + 7 + 2 > FRAME_CACHE_SLOT)
+		return;					// Silly amounts of sync; don't cache
+
+	m_frame_cache.resize(FIXED_COMMANDS * 128 * 4 * FRAME_CACHE_SLOT);
+	for(unsigned c = 0; c < FIXED_COMMANDS; c++) {
+		for(int addr = 0; addr < 128; addr++) {
+			for(int seq = 0; seq < 4; seq++) {
+				int len = encode(addr, seq, fixed_commands[c].size,
+								 fixed_commands[c].payload);
+				memcpy(&m_frame_cache[((c * 128 + addr) * 4 + seq) *
+									  FRAME_CACHE_SLOT],
+					   m_out_buffer, len);
+			}
+		}
+	}
+}
+
+const uint8_t *protocol::cached_frame(int addr, int seq, int size,
+									  const uint8_t *payload, int *len) {
+	if(m_frame_cache.empty() || size > 2)
+		return NULL;
+	for(unsigned c = 0; c < FIXED_COMMANDS; c++) {
+		if(fixed_commands[c].size == size &&
+		   memcmp(fixed_commands[c].payload, payload, size) == 0) {
+			*len = m_config.lead + 7 + size + m_config.trail;
+			return &m_frame_cache[(((c * 128) + (addr & 0x7F)) * 4 +
+								   (seq & 0x03)) * FRAME_CACHE_SLOT];
+		}
+	}
+	return NULL;
+}
+
+int protocol::encode(int addr, int seq, int size, const uint8_t *payload) {
 	// copy to m_buffer with proper envelope
 	unsigned char *out = m_out_buffer, *postpad;
 	int fullsize = size + 7;	// add wrapping bytes
@@ -577,26 +944,146 @@ int protocol::writecook(int addr, int seq, int size, const uint8_t *payload) {
 	for(int i = 0; i < m_config.trail; i++)
 		*out++ = 0xFF;
 
+	return out - m_out_buffer;
+}
+
+int protocol::writecook(int addr, int seq, int size, const uint8_t *payload) {
+	// Have the frame completely ready before the turnaround wait, so
+	// transmission starts the moment the gap is over.
+	frame_out(addr, seq, size, payload);
 	delaywait();				// Wait until it's okay to send
+	return protocol::writev(m_out_iov, m_out_iovcnt);
+}
+
+int protocol::writecook(int addr, int seq, const blob &msg) {
+	frame_out(addr, seq, msg);
+	delaywait();				// Wait until it's okay to send
+	return protocol::writev(m_out_iov, m_out_iovcnt);
+}
+
+void protocol::frame_out(int addr, int seq, int size, const uint8_t *payload) {
+	// Fixed commands come ready-made from the cache.
+	int len;
+	const uint8_t *frame = cached_frame(addr, seq, size, payload, &len);
+	if(frame == NULL) {
+		len = encode(addr, seq, size, payload);
+		frame = m_out_buffer;
+	}
+
+	m_out_iov[0].iov_base = (void *)frame; // (for rexmit)
+	m_out_iov[0].iov_len = len;
+	m_out_iovcnt = 1;
+	m_out_blob.clear();
+	m_out_len = len;
+}
+
+void protocol::frame_out(int addr, int seq, const blob &msg) {
+	int size = msg.size();
+	const uint8_t *payload = (const uint8_t *)msg.pvoid();
+
+	// Fixed commands still go out whole from the frame cache
+	int len;
+	if(cached_frame(addr, seq, size, payload, &len) != NULL) {
+		frame_out(addr, seq, size, payload);
+		return;
+	}
 
-	m_out_len = out - m_out_buffer;	// size of written msg (for rexmit)
+	// Otherwise, only the envelope is built, in m_out_buffer:
+	// header first, then the trailer, and the payload is sent
+	// from where it sits.
+	unsigned char *out = m_out_buffer, *postpad;
+	int fullsize = size + 7;
+	for(int i = 0; i < m_config.lead; i++)
+		*out++ = 0xFF;
+
+	postpad = out;
+	*out++ = chSOH;
+	*out++ = addr & 0x7F;
+	*out++ = fullsize & 0xff;
+	*out++ = (fullsize >> 8) & 0xff;
+	*out++ = seq | 0x04;		// seq#, CRC indicator
+	int header = out - m_out_buffer;
+
+	uint16_t crc, icrc;
+	crc16_prepare(crc);
+	crc = crc16_add(crc, postpad, out-postpad);
+	crc = crc16_add(crc, payload, size);
+	icrc = crc16_digest(crc);
+	*out++ = icrc & 0xFF;
+	*out++ = (icrc >> 8) & 0xFF;
 
-	return protocol::write(m_out_buffer, m_out_len);
+	for(int i = 0; i < m_config.trail; i++)
+		*out++ = 0xFF;
+
+	m_out_iov[0].iov_base = m_out_buffer;
+	m_out_iov[0].iov_len = header;
+	m_out_iov[1].iov_base = (void *)payload;
+	m_out_iov[1].iov_len = size;
+	m_out_iov[2].iov_base = m_out_buffer + header;
+	m_out_iov[2].iov_len = (out - m_out_buffer) - header;
+	m_out_iovcnt = 3;
+	m_out_blob = msg;
+	m_out_len = (out - m_out_buffer) + size;
 }
 
 int protocol::write(int size) {
+	m_out_iov[0].iov_base = m_out_buffer;
+	m_out_iov[0].iov_len = size;
+	m_out_iovcnt = 1;
+	m_out_blob.clear();
 	m_out_len = size;
 	return write(m_out_buffer, size);
 }
 
 int protocol::write(const uint8_t *buffer, int size) {
+	struct iovec iov;
+	iov.iov_base = (void *)buffer;
+	iov.iov_len = size;
+	return writev(&iov, 1);
+}
+
+int protocol::writev(const struct iovec *iov, int count) {
 	// Transmit!
-	int offset = 0;
+	struct iovec pieces[3];		// (what's left to write)
+	int size = tx_begin(iov, count, pieces);
+	struct iovec *left = pieces;
+	while(write_some(&left, &count)) {
+		// Wait until the fd is writable.
+		struct pollfd fds[1];
+		fds[0].events = POLLOUT;
+		fds[0].fd = m_fd;
+		fds[0].revents = 0;
+
+		poll(fds, 1, 1000);
+	}
+	tx_done();
+	return size;
+}
 
-	xlog(buffer, size);
+int protocol::tx_begin(const struct iovec *iov, int count, struct iovec *pieces) {
+	if(count > 3)
+		throw protocol_exception("too many pieces to write");
+	int size = 0;
+	for(int n = 0; n < count; n++) {
+		pieces[n] = iov[n];
+		size += iov[n].iov_len;
+		xlog((const uint8_t *)iov[n].iov_base, iov[n].iov_len);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &m_tx_start);
+	m_tx_bytes = size;
+	if(m_config.echo_cancel) {
+		memcpy(m_echo_iov, iov, count * sizeof(*iov));
+		m_echo_iovcnt = count;
+		m_echo_len = size;
+		m_echo_at = 0;
+	}
+	return size;
+}
 
-	while(offset < size) {
-		int i = ::write(m_fd, m_out_buffer + offset, size - offset);
+bool protocol::write_some(struct iovec **pieces, int *count) {
+	struct iovec *&left = *pieces;
+	while(*count > 0) {
+		int i = ::writev(m_fd, left, *count);
 
 		if(i == 0) {
 			errno = EAGAIN;		// Turn 0-length into "wait"
@@ -611,34 +1098,51 @@ int protocol::write(const uint8_t *buffer, int size) {
 #if EAGAIN != EWOULDBLOCK
 			case EWOULDBLOCK:
 #endif
-			{
-				// Wait until the fd is writable.
-				struct pollfd fds[1];
-				fds[0].events = POLLOUT;
-				fds[0].fd = m_fd;
-				fds[0].revents = 0;
-
-				i = poll(fds, 1, 1000);
-				continue;			// Go try again
-			}
+				return true;	// (the rest when it's writable)
 			default:
 				throw protocol_exception("write I/O error");
 			}
 		}
-		offset += i;
+		// Skip past what was written
+		while(*count > 0 && (size_t)i >= left->iov_len) {
+			i -= left->iov_len;
+			left++;
+			(*count)--;
+		}
+		if(*count > 0) {
+			left->iov_base = (uint8_t *)left->iov_base + i;
+			left->iov_len -= i;
+		}
 	}
+	return false;				// all written
+}
 
-	return size;
+void protocol::tx_done(void) {
+	// It's been on the wire since (about) m_tx_start, unless the
+	// driver took it slower than it goes out: then what it still holds
+	// has yet to go.  (TIOCOUTQ doesn't count the UART's own FIFO or
+	// shift register, nor a USB adapter's buffer, so it's a lower
+	// bound; the wire time from the start covers those.)
+	m_tx_end = m_tx_start;
+	add_us(m_tx_end, wire_us(m_tx_bytes));
+	int queued;
+	if(ioctl(m_fd, TIOCOUTQ, &queued) == 0 && queued > 0) {
+		struct timespec end;
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		add_us(end, wire_us(queued));
+		if(m_tx_end < end)
+			m_tx_end = end;
+	}
 }
 
 int protocol::resend() {
-	if(m_out_len <= 0) {
+	if(m_out_iovcnt <= 0) {
 		memo("resend() but nothing to resend!");
 		return 0;
 	}
 
 	delaywait();				// Wait until it's okay to send
-	return protocol::write(m_out_len);
+	return protocol::writev(m_out_iov, m_out_iovcnt);
 }
 
 void protocol::xlog(const uint8_t *buffer, int size) {
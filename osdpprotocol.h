@@ -4,12 +4,17 @@
 #include "osdp_def.h"
 
 #include <string>
+#include <vector>
 #include <exception>
 #include <boost/thread/locks.hpp>
 #include <boost/thread/thread.hpp>
 
 #include <cstdint>
 
+#include <sys/uio.h>
+
+#include "blob.h"
+
 #define PROTO_ERR_TIMEOUT -1
 //#define PROTO_ERR_IO -2
 #define PROTO_ERR_OVERFLOW -3
@@ -21,6 +26,8 @@
 
 #define OSDPPROTO_BUFFER_SIZE 1024
 
+#define FRAME_CACHE_SLOT 32		// bytes per pre-encoded frame
+
 class protocol_exception: public std::exception {
 protected:
 	std::string msg;
@@ -54,9 +61,12 @@ struct serial_config {
 	char usb;
 	char lead;					// How many leading sync chars
 	char trail;					// How many trailing sync chars
+	char echo_cancel;			// Skip my own frames if they come back
 	long timeout;		   // read timeout, MICROseconds
 	long delay;			   // MICROseconds after receipt before rexmit
 	long idle;			   // idle timeout (MICROseconds)
+	int latency_timer;	   // USB-serial latency timer to set,
+						   // milliseconds (0: leave it be)
 };
 
 // An instance of "protocol" manages the serial protocol to a COM port.
@@ -66,6 +76,11 @@ protected:
 	boost::mutex m_protolock;	// serialize access when needed
 
 	int m_fd;			// COM port file descriptor
+
+	// Hot standby: a second port on the same bus, kept open so I can
+	// switch to it at once.  (Its own USB tuning state goes with it.)
+	const char *m_port2;		// its name, or NULL if none
+	int m_fd2;					// its descriptor, or -1 if not open
 	
 	// Serial port settings
 	struct serial_config m_config; // serial params
@@ -75,13 +90,60 @@ protected:
 	unsigned char m_out_buffer[SLAVE_BUFF_SIZE]; // transmit buffer
 	uint16_t m_out_len;					// Length of last sent message
 
+	// The last sent message, as it went out (for rexmit): one piece
+	// from m_out_buffer or the frame cache, or header/payload/trailer
+	// with the payload still in its blob.
+	struct iovec m_out_iov[3];
+	int m_out_iovcnt;
+	blob m_out_blob;			// keeps m_out_iov's payload alive
+
+	// Pre-encoded frames for the fixed commands (POLL, ID, ...), for
+	// every address and sequence number, sync bytes and CRC included.
+	std::vector<uint8_t> m_frame_cache;	// empty if lead+trail too long
+	void build_frame_cache(void);
+	const uint8_t *cached_frame(int addr, int seq, int size,
+								const uint8_t *payload, int *len);
+
+	int encode(int addr, int seq, int size, const uint8_t *payload);
+
 	uint8_t m_my_addr;					// My address.
 
 	struct timespec m_next_write;	// when the next xmit can happen
 
+	// For airtime accounting: when the last transmission started,
+	// how long it was, and time spent holding off before transmitting
+	// (since it was last taken).
+	struct timespec m_tx_start;
+	int m_tx_bytes;
+	long m_delayed_us;
+
+	// When the last frame's last stop bit will have left (the reply
+	// timeout counts from then, not from when write() returned)
+	struct timespec m_tx_end;
+	void tx_done(void);
+
+	// Echo cancelling: some 2-wire adapters hand back every byte I
+	// send.  Received bytes are matched against the last frame sent
+	// (as it went out, in m_echo_iov), and skipped while they match.
+	struct iovec m_echo_iov[3];
+	int m_echo_iovcnt;
+	int m_echo_len;				// bytes to expect back (0: none)
+	int m_echo_at;				// ...and how many have come
+	long m_echoed;				// frames that came back
+	uint8_t echo_byte(int at) const;
+	int skip_echo(uint8_t *buffer, int size);
+
 	struct timespec m_deadline;	// The time at which the current read
 								// will timeout
 
+	// USB-serial tuning: the adapter's latency timer in sysfs (if it
+	// has one), and what it was before I set it
+	struct usb_tuning {
+		char latency_path[128];
+		int latency_saved;
+		bool low_latency;		// ASYNC_LOW_LATENCY took
+	} m_usb, m_usb2;			// (active port, standby port)
+
 	void readstamp(void);		// compute m_next_write from NOW
 	void delaywait(void);		// wait until m_next_write
 
@@ -89,6 +151,12 @@ protected:
 	int readsoh();
 	int readeof(int offset);	// after SOH, reads message
 	int flyby(int offset); // fly past other device's msg
+	int readlong(int offset);	// (or keep the start of a long one)
+
+	// (Monitor mode) frames too long for m_in_buffer, like a big
+	// MFG or FILETRANSFER: keep their start rather than fail them
+	bool m_keep_long;
+	int m_long_size;			// the last frame's whole size, if cut short
 
 	int write(int len);
 
@@ -105,9 +173,29 @@ public:
 
 	int readcook(void);		// read(), check timing, framing, CRC
 
+	// readcook() in pieces, for callers that do their own waiting (as
+	// busloop's coroutines do): set m_deadline, then take what's
+	// arrived until it's a whole frame.  read_frame() returns 0 until
+	// then, with "have" bytes of it in m_in_buffer.
+	void read_deadline(void);
+	int read_frame(int &have);
+	int check_frame(int size);	// CRC or checksum; size without it
+
 	int writecook(int addr, int seq, int size, const uint8_t *payload);
 
+	int writecook(int addr, int seq, const blob &msg); // (zero-copy)
+
+	// writecook() in pieces, likewise: make the frame (into
+	// m_out_iov), wait while holdoff() says so, then tx_begin() and
+	// write_some() until it says it's all gone, then tx_done().
+	void frame_out(int addr, int seq, int size, const uint8_t *payload);
+	void frame_out(int addr, int seq, const blob &msg);
+	bool holdoff(void);			// true: not before m_next_write
+	int tx_begin(const struct iovec *iov, int count, struct iovec *pieces);
+	bool write_some(struct iovec **pieces, int *count); // true: more to go
+
 	int write(const uint8_t *buffer, int size);
+	int writev(const struct iovec *iov, int count);
 	int resend();
 
 	int waitidle(void);			// Wait until inter-message gap
@@ -118,6 +206,18 @@ public:
 
 	void close(void);			// close port
 
+	bool try_prepcom(void);		// prepcom(), or close and say false
+	void swap_ports(void);		// standby is now active, and vice versa
+	bool open_standby(void);	// (re)open the standby; false if I can't
+	bool standby_ok(void);		// open, and still there?
+	void close_standby(void);
+
+	// (USB) Tune the port for quick turnarounds, or put back how it
+	// was.  Returns false if there's nothing to tune.
+	bool low_latency(bool on);
+	int usb_report(char *text, size_t size); // the effective settings,
+											 // as JSON
+
 	const unsigned char *in_msg() const { return m_in_buffer; }
 
 	inline long timeout(void) const { return m_config.timeout; }
@@ -127,11 +227,24 @@ public:
 	inline long idle(long t) { long old_t = m_config.idle; m_config.idle = t; return old_t; }
 
 	inline uint8_t addr() const { return m_my_addr; }
+	inline void keep_long(bool yn) { m_keep_long = yn; }
+	inline int long_size() const { return m_long_size; }
 	inline uint8_t addr(uint8_t addr) { uint8_t x = m_my_addr; m_my_addr = addr; return x; }
 
 	inline uint8_t *out_buffer() { return m_out_buffer; }
 	inline int out_buffer_size() const { return sizeof(m_out_buffer); }
 
+	long wire_us(int bytes) const;	// time on the wire, MICROseconds
+
+	inline const struct timespec &tx_start() const { return m_tx_start; }
+	inline int tx_bytes() const { return m_tx_bytes; }
+	inline const struct timespec &tx_end() const { return m_tx_end; }
+	inline long echoed() const { return m_echoed; }
+
+	inline const char *port2(void) const { return m_port2; }
+	inline const char *port2(const char *n) { const char *t = m_port2; m_port2 = n; return t; }
+	inline long take_delayed() { long d = m_delayed_us; m_delayed_us = 0; return d; }
+
 	inline long delay() const { return m_config.delay; }
 	inline int baud() const { return m_config.baud; }
 };
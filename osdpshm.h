@@ -0,0 +1,187 @@
+#ifndef OSDPSHM_H
+#define OSDPSHM_H
+
+// Shared-memory interface to osdpmaster, for clients on the same box
+// (enabled by "shm = true" in [port]).  It's one segment per bus,
+// /dev/shm/osdpmaster.bus<n>, holding two rings:
+//
+// Frames: every reply a PD sends (but ACKs), in order.  osdpmaster
+// writes and never waits; any number of clients read, each at its own
+// pace, and one that falls a whole ring behind loses the oldest.
+//
+// Commands: what clients want sent, as they'd publish to
+// osdp/bus<n>/outgoing/<addr>.  Any number of clients write; the bus
+// thread takes them between polls.  (A client that dies halfway
+// through writing one holds up the rest until osdpmaster restarts.)
+//
+// Everything here is inline, C or C++, so a client needs nothing but
+// this header (and -lrt, for shm_open, with older glibc).
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define OSDPSHM_MAGIC 0x4D485344	// "DSHM"
+#define OSDPSHM_VERSION 1
+#define OSDPSHM_FRAMES 1024			// slots; must be a power of 2
+#define OSDPSHM_COMMANDS 256		// slots; must be a power of 2
+#define OSDPSHM_FRAME_DATA 288		// room for the largest reply osdpmaster reads
+#define OSDPSHM_COMMAND_DATA 1433	// room for the largest command (a
+									// 1440-byte frame, less its header
+									// and CRC)
+
+#define OSDPSHM_BY_UUID 0x7F		// (as an address: go by uuid instead)
+#define OSDPSHM_DURABLE 0x01		// (command flag: journal it)
+
+struct osdpshm_frame {
+	uint64_t seq;				// frame number + 1 (0 while being written)
+	uint64_t stamp_ns;			// when it arrived (CLOCK_REALTIME)
+	uint8_t addr;				// from this PD
+	uint8_t pad;
+	uint16_t len;
+	uint8_t data[OSDPSHM_FRAME_DATA]; // the reply, from its code on
+};
+
+struct osdpshm_command {
+	uint64_t seq;				// ring-position bookkeeping
+	uint8_t addr;				// for this PD (or OSDPSHM_BY_UUID)
+	uint8_t flags;
+	int8_t cls;					// priority class, or -1 by command code
+	uint8_t pad;
+	uint16_t len;
+	uint8_t uuid[16];
+	uint8_t data[OSDPSHM_COMMAND_DATA]; // the command, from its code on
+};
+
+struct osdpshm {
+	uint32_t magic;				// (set last, once it's all ready)
+	uint32_t version;
+	uint32_t frames;			// OSDPSHM_FRAMES
+	uint32_t commands;			// OSDPSHM_COMMANDS
+
+	uint64_t frame_tail __attribute__((aligned(64))); // frames written
+	struct osdpshm_frame frame[OSDPSHM_FRAMES];
+
+	uint64_t command_tail __attribute__((aligned(64))); // commands claimed
+	uint64_t command_head __attribute__((aligned(64))); // commands taken
+	struct osdpshm_command command[OSDPSHM_COMMANDS];
+};
+
+// Where a client is in the frame ring
+struct osdpshm_reader {
+	uint64_t cursor;			// next frame number to read
+	uint64_t lost;				// frames overwritten before I read them
+};
+
+static inline void osdpshm_name(int bus, char *name, size_t size) {
+	snprintf(name, size, "/osdpmaster.bus%d", bus);
+}
+
+// Map bus <n>'s segment; NULL if osdpmaster hasn't made it (yet).
+static inline struct osdpshm *osdpshm_open(int bus) {
+	char name[32];
+	osdpshm_name(bus, name, sizeof(name));
+	int fd = shm_open(name, O_RDWR, 0);
+	if(fd < 0)
+		return NULL;
+	void *p = mmap(NULL, sizeof(struct osdpshm), PROT_READ|PROT_WRITE,
+				   MAP_SHARED, fd, 0);
+	close(fd);
+	if(p == MAP_FAILED)
+		return NULL;
+	struct osdpshm *shm = (struct osdpshm *)p;
+	if(__atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) != OSDPSHM_MAGIC ||
+	   shm->version != OSDPSHM_VERSION || shm->frames != OSDPSHM_FRAMES ||
+	   shm->commands != OSDPSHM_COMMANDS) {
+		munmap(p, sizeof(struct osdpshm));
+		return NULL;
+	}
+	return shm;
+}
+
+static inline void osdpshm_close(struct osdpshm *shm) {
+	munmap(shm, sizeof(struct osdpshm));
+}
+
+// Start reading with the next frame to arrive
+static inline void osdpshm_start(struct osdpshm *shm, struct osdpshm_reader *r) {
+	r->cursor = __atomic_load_n(&shm->frame_tail, __ATOMIC_ACQUIRE);
+	r->lost = 0;
+}
+
+// Copy out the next frame; returns 1 if there was one, 0 if not.
+// (It doesn't block: poll, or spin.)
+static inline int osdpshm_next(struct osdpshm *shm, struct osdpshm_reader *r,
+							   struct osdpshm_frame *f) {
+	for(;;) {
+		uint64_t tail = __atomic_load_n(&shm->frame_tail, __ATOMIC_ACQUIRE);
+		if(r->cursor >= tail)
+			return 0;
+		if(tail - r->cursor > OSDPSHM_FRAMES) {
+			r->lost += tail - OSDPSHM_FRAMES - r->cursor;
+			r->cursor = tail - OSDPSHM_FRAMES;
+		}
+		struct osdpshm_frame *s = &shm->frame[r->cursor & (OSDPSHM_FRAMES-1)];
+		uint64_t seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+		if(seq == r->cursor + 1) {
+			memcpy(f, s, sizeof(*f));
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if(__atomic_load_n(&s->seq, __ATOMIC_RELAXED) == seq) {
+				r->cursor++;
+				return 1;
+			}
+		}
+		// Overwritten before (or while) I copied it
+		r->lost++;
+		r->cursor++;
+	}
+}
+
+// Queue a command for the PD at "addr" (or, if that's
+// OSDPSHM_BY_UUID, the one with "uuid").  Returns 0, or -1 if it
+// won't fit or the ring is full.
+static inline int osdpshm_send(struct osdpshm *shm, uint8_t addr,
+							   const uint8_t *uuid, int cls, int flags,
+							   const void *data, int len) {
+	if(len <= 0 || len > OSDPSHM_COMMAND_DATA)
+		return -1;
+	uint64_t pos = __atomic_load_n(&shm->command_tail, __ATOMIC_RELAXED);
+	struct osdpshm_command *c;
+	for(;;) {
+		c = &shm->command[pos & (OSDPSHM_COMMANDS-1)];
+		uint64_t seq = __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE);
+		int64_t dif = (int64_t)(seq - pos);
+		if(dif == 0) {
+			if(__atomic_compare_exchange_n(&shm->command_tail, &pos, pos+1, 1,
+										   __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;			// slot is mine
+		}
+		else if(dif < 0)
+			return -1;			// full
+		else
+			pos = __atomic_load_n(&shm->command_tail, __ATOMIC_RELAXED);
+	}
+	c->addr = addr;
+	c->flags = flags;
+	c->cls = cls;
+	c->len = len;
+	if(uuid)
+		memcpy(c->uuid, uuid, sizeof(c->uuid));
+	else
+		memset(c->uuid, 0, sizeof(c->uuid));
+	memcpy(c->data, data, len);
+	__atomic_store_n(&c->seq, pos+1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+#ifdef __cplusplus
+}
+#endif
+#endif // OSDPSHM_H
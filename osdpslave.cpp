@@ -1,6 +1,9 @@
 #include "osdpslave.h"
-#include "osdpmaster.h"
+#include "busprotocol.h"
 
+#include <sstream>
+
+#include "split.h"
 #include "timespec.h"
 
 using namespace std;
@@ -32,28 +35,302 @@ bool mem_zero(const uint8_t *p, int size) {
 
 osdpslave::osdpslave(class busprotocol *bus)
 	: m_bus(bus), m_retry(OSDPSLAVE_RETRY_MAX+1),
-	  m_next_assign{0,0},
+	  m_next_assign{0,0}, m_probe_ms(0), m_inflight(-1),
+	  m_inflight_bytes(0), m_starve(8),
+	  m_queued(0), m_queued_bytes(0), m_max_msgs(0), m_max_bytes(0),
+	  m_policy(QUEUE_REJECT), m_max_latency(0), m_shed(0),
+	  m_pinned(0), m_pinned_bytes(0),
+	  m_dropped(0), m_rejected(0), m_cycle_us(0), m_visited{0,0},
 	  m_txseq(0), m_rxseq(0), m_addr(0xFF),
-	  m_setrtc(false), m_enabled(true) {
+	  m_setrtc(false), m_enabled(true), m_reply_us(0), m_refresh(0) {
 	memset(m_uuid, 0, sizeof(m_uuid));
+	memset(m_passed, 0, sizeof(m_passed));
+	memset(&m_wire, 0, sizeof(m_wire));
+	memset(m_airtime, 0, sizeof(m_airtime));
 }
 
 osdpslave::~osdpslave() {
 	retire();
 }
 
+void osdpslave::set_uuid(const uuid_t u) {
+	m_bus->unindex_slave(*this);
+	memcpy(m_uuid, u, sizeof(m_uuid));
+	m_bus->index_slave(*this);
+}
+
+uint8_t osdpslave::addr(uint8_t a) {
+	m_bus->unindex_slave(*this);
+	m_addr = a;
+	m_bus->index_slave(*this);
+	return a;
+}
+
 bool osdpslave::defined(void) const {
 	return(m_addr != 0xFF || !mem_zero(m_uuid, sizeof(m_uuid)));
 }
 
+msgclass_t msg_class(const blob &cmd) {
+	const blob::const_blobvec_t &c = cmd.get();
+	if(c.empty())
+		return MSG_NORMAL;
+	switch(c[0]) {
+	case OSDP_OUT:
+	case OSDP_LED:
+	case OSDP_BUZ:
+	case OSDP_TEXT:
+		return MSG_INTERACTIVE;
+	case OSDP_DATA:
+	case OSDP_MFG:
+		return MSG_BULK;
+	default:
+		return MSG_NORMAL;
+	}
+}
+
+qpolicy_t queue_policy(const char *name) {
+	if(strcmp(name, "drop_oldest") == 0)
+		return QUEUE_DROP_OLDEST;
+	if(strcmp(name, "drop_newest") == 0)
+		return QUEUE_DROP_NEWEST;
+	if(strcmp(name, "reject") == 0)
+		return QUEUE_REJECT;
+	return QUEUE_ADMIT;
+}
+
+void osdpslave::limits(size_t msgs, size_t bytes, qpolicy_t policy,
+					   long latency_ms) {
+	m_max_msgs = msgs;
+	m_max_bytes = bytes;
+	m_policy = policy;
+	m_max_latency = latency_ms;
+}
+
+qpolicy_t osdpslave::admit(size_t bytes, const char **why) {
+	size_t queued = m_queued;
+	if(m_max_latency > 0 && m_cycle_us > 0 &&
+	   (long)(queued + 1) * m_cycle_us > m_max_latency * 1000) {
+		// I'm sent one message per poll, so that's how long it'd wait
+		*why = "latency";
+		return QUEUE_REJECT;
+	}
+	if(m_max_msgs > 0 && queued + 1 > m_max_msgs) {
+		*why = "msgs";
+		return shed_or(m_policy, queued + 1 - m_max_msgs, 0);
+	}
+	if(m_max_bytes > 0 && (size_t)m_queued_bytes + bytes > m_max_bytes) {
+		*why = "bytes";
+		return shed_or(m_policy, 0, m_queued_bytes + bytes - m_max_bytes);
+	}
+	// (Over the bus's limits, I shed one more for each)
+	return shed_or(m_bus->admit(bytes, why), m_shed + 1, 0);
+}
+
+qpolicy_t osdpslave::shed_or(qpolicy_t policy, size_t msgs, size_t bytes) const {
+	// Dropping the oldest is only a way to make room if enough of
+	// what's queued may go: not what's in flight, nor durables.  If
+	// not, the newest goes instead.
+	if(policy != QUEUE_DROP_OLDEST)
+		return policy;
+	int inflight = m_inflight >= 0;
+	long may = (long)m_queued - m_pinned - inflight;
+	long may_bytes = (long)m_queued_bytes - m_pinned_bytes -
+		(inflight ? m_inflight_bytes : 0);
+	if(may < (long)msgs || may_bytes < (long)bytes)
+		return QUEUE_DROP_NEWEST;
+	return policy;
+}
+
+void osdpslave::push(const osdpmsg &msg, msgclass_t cls) {
+	katomic_inc(&m_queued);
+	katomic_add(&m_queued_bytes, msg.data.size());
+	if(msg.durable()) {
+		katomic_inc(&m_pinned);
+		katomic_add(&m_pinned_bytes, msg.data.size());
+	}
+	m_bus->queued(1, msg.data.size());
+	m_msglist[cls].push(msg);
+}
+
+void osdpslave::dequeued(const osdpmsg &msg) {
+	katomic_add(&m_queued, -1);
+	katomic_add(&m_queued_bytes, -(int)msg.data.size());
+	if(msg.durable()) {
+		katomic_add(&m_pinned, -1);
+		katomic_add(&m_pinned_bytes, -(int)msg.data.size());
+	}
+	m_bus->queued(-1, -(long)msg.data.size());
+}
+
+bool osdpslave::over(void) const {
+	return m_shed > 0 ||
+		(m_max_msgs > 0 && (size_t)m_queued > m_max_msgs) ||
+		(m_max_bytes > 0 && (size_t)m_queued_bytes > m_max_bytes);
+}
+
+void osdpslave::shed(void) {
+	// Drop oldest first, from the least urgent class; but never what
+	// I'm in the middle of sending, nor a durable message (those stay
+	// put, and what's behind them can still go).
+	for(int c = MSG_CLASSES-1; c >= 0 && over(); c--) {
+		m_msglist[c].remove_if([this](const osdpmsg &msg) {
+			if(msg.durable() || !over())
+				return false;
+			dequeued(msg);
+			katomic_inc(&m_dropped);
+			if(m_shed > 0)
+				katomic_add(&m_shed, -1);
+			return true;
+		}, c == m_inflight ? 1 : 0);
+	}
+	m_shed = 0;					// (admit() asks for no more than I can
+								// drop, but just in case)
+}
+
+void osdpslave::visit(const struct timespec &now) {
+	if(m_visited.tv_sec != 0) {
+		struct timespec dt = now - m_visited;
+		long us = dt.tv_sec * 1000000 + dt.tv_nsec / 1000;
+		m_cycle_us = m_cycle_us ? (m_cycle_us * 7 + us) / 8 : us;
+	}
+	m_visited = now;
+}
+
+int osdpslave::stats(char *text, size_t size) {
+	int len = snprintf(text, size,
+					   "{\"queued\":%d,\"queued_bytes\":%d,"
+					   "\"dropped\":%d,\"rejected\":%d,\"cycle_us\":%ld,"
+					   "\"airtime\":",
+					   (int)m_queued, (int)m_queued_bytes,
+					   (int)m_dropped, (int)m_rejected, m_cycle_us);
+	if((size_t)len < size)
+		len += airtime(text + len, size - len);
+	if((size_t)len < size)
+		len += snprintf(text + len, size - len, "}");
+	return len;
+}
+
+const char *aircat_names[AIR_CATEGORIES] = {
+	"payload", "poll", "turnaround", "delay", "timeout", "retry", "probe"
+};
+
+int osdpslave::airtime(char *text, size_t size) {
+	int len = 0;
+	for(int c = 0; c < AIR_CATEGORIES && (size_t)len < size; c++) {
+		len += snprintf(text + len, size - len, "%c\"%s_us\":%ld",
+						c ? ',' : '{', aircat_names[c], m_airtime[c]);
+		m_airtime[c] = 0;
+	}
+	if((size_t)len < size)
+		len += snprintf(text + len, size - len, "}");
+	return len;
+}
+
+bool osdpslave::empty(void) {
+	for(int c = 0; c < MSG_CLASSES; c++)
+		if(!m_msglist[c].empty())
+			return false;
+	return true;
+}
+
+osdpmsg osdpslave::front(void) {
+	if(m_inflight < 0) {
+		// Pick the most urgent class with something queued, unless a
+		// less urgent one has waited long enough.
+		int pick = -1;
+		for(int c = 0; c < MSG_CLASSES; c++) {
+			if(m_msglist[c].empty())
+				continue;
+			if(pick < 0)
+				pick = c;
+			else if(m_passed[c] >= m_starve) {
+				pick = c;		// its turn
+				break;
+			}
+		}
+		if(pick < 0) {
+			osdpmsg empty;
+			return empty;
+		}
+		for(int c = pick+1; c < MSG_CLASSES; c++)
+			if(!m_msglist[c].empty())
+				m_passed[c]++;
+		m_passed[pick] = 0;
+		m_inflight = pick;
+		m_inflight_bytes = m_msglist[pick].front().data.size();
+	}
+	return m_msglist[m_inflight].front();
+}
+
+void osdpslave::pop(void) {
+	if(m_inflight < 0)
+		return;
+	osdpmsg &msg = m_msglist[m_inflight].front();
+	if(msg.durable() && m_bus->journal())
+		m_bus->journal()->done(msg.journal); // delivered; forget it
+	dequeued(msg);
+	m_msglist[m_inflight].pop();
+	m_inflight = -1;
+}
+
 void osdpslave::purge(void) {
-	while(!m_msglist.empty())
-		m_msglist.pop();
+	// Durable messages survive; they go round to the back again, in
+	// their original order.
+	for(int c = 0; c < MSG_CLASSES; c++) {
+		size_t n = m_msglist[c].size();
+		for(size_t i = 0; i < n; i++) {
+			osdpmsg msg = m_msglist[c].front();
+			m_msglist[c].pop();
+			if(msg.durable())
+				m_msglist[c].push(msg);
+			else
+				dequeued(msg);
+		}
+		m_passed[c] = 0;
+	}
+	m_inflight = -1;			// (choose afresh)
+}
+
+// Hex commands, one per word
+static bool parse_commands(const string &text, vector<blob> &cmds) {
+	vector<string> words;
+	split(text, words, ' ');
+	for(auto w = words.begin(); w != words.end(); w++) {
+		if(w->empty())
+			continue;
+		istringstream in(*w);
+		blob cmd;
+		in >> cmd;
+		if(cmd.size() == 0 || cmd.size() * 2 != w->size())
+			return false;
+		cmds.push_back(cmd);
+	}
+	return true;
+}
+
+bool osdpslave::decision(const string &grant, const string &deny) {
+	m_grant.clear();
+	m_deny.clear();
+	return parse_commands(grant, m_grant) && parse_commands(deny, m_deny);
+}
+
+void osdpslave::decide(bool grant) {
+	// (Mine, not an app's: no backpressure, and they're interactive
+	// whatever they are)
+	vector<blob> &cmds = grant ? m_grant : m_deny;
+	for(auto c = cmds.begin(); c != cmds.end(); c++)
+		push(osdpmsg(*c), MSG_INTERACTIVE);
 }
 
 void osdpslave::retire(void) {
-	// return queued msg blocks to free memory
-	purge();
+	// return queued msg blocks to free memory.  (Durable ones stay
+	// live in the journal, to be replayed when I'm back.)
+	for(int c = 0; c < MSG_CLASSES; c++)
+		while(!m_msglist[c].empty()) {
+			dequeued(m_msglist[c].front());
+			m_msglist[c].pop();
+		}
+	m_inflight = -1;
 	memset(m_uuid, 0, sizeof(m_uuid)); // bye bye
 	m_addr = 0xFF;
 	m_retry = OSDPSLAVE_RETRY_MAX+1;
@@ -88,8 +365,10 @@ void osdpslave::init(void) {
 void osdpslave::ack(void) {
 	m_txseq = next_seq(m_txseq);
 	if(offline()) {				// I thought I was offline?
+		forget_replies();		// (subscribers want fresh state)
 		declare_online(true);
 	}
+	m_probe_ms = 0;				// (next time offline, probe promptly)
 	m_retry = 0;				// Retry count zero
 }
 
@@ -112,6 +391,40 @@ void osdpslave::nak(void) {
 	}
 }
 
+void osdpslave::change_only(uint8_t code) {
+	reply_memo &m = m_change_only[code];
+	m.valid = false;
+	m.data.reserve(SLAVE_BUFF_SIZE); // so changed() never allocates
+}
+
+void osdpslave::forget_replies(void) {
+	for(auto i = m_change_only.begin(); i != m_change_only.end(); i++)
+		i->second.valid = false;
+}
+
+bool osdpslave::changed(const uint8_t *reply, int len) {
+	if(len <= 0 || m_change_only.empty())
+		return true;
+	auto i = m_change_only.find(reply[0]);
+	if(i == m_change_only.end())
+		return true;			// not filtered
+
+	reply_memo &m = i->second;
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if(m.valid &&
+	   m.data.size() == (size_t)len &&
+	   memcmp(&m.data[0], reply, len) == 0 &&
+	   (m_refresh <= 0 || now < m.refresh))
+		return false;			// same old news
+
+	m.valid = true;
+	m.data.assign(reply, reply + len);
+	m.refresh = now;
+	m.refresh.tv_sec += m_refresh;
+	return true;
+}
+
 bool osdpslave::welcome(void) {
 	// I don't know what the sequence numbers would be...
 	m_txseq = 0; // As an indicator, make this 0
@@ -122,29 +435,10 @@ bool osdpslave::welcome(void) {
 }
 
 void osdpslave::declare_online(bool tf) {
-	ostringstream topic;
-	if(mem_zero(uuid(), 16)) {
-		topic << "osdpiom/bus1/incoming/" << (int)addr() << "/status";
-	}
-	else {
-		char sayuuid[36];
-		uuid_unparse(uuid(), sayuuid);
-		topic << "osdpiom/bus1/incoming/" << sayuuid << "/status";
-	}
 	const char *val = "OFFLINE";
 	if(tf)
 		val = "ONLINE";
 	if(!enabled())
 		val = "DISABLED";
-	// Set final arg "true" to make this the "first message" of the
-	// topic.  The MQTT broker will keep a copy, and any app that
-	// subscribes will get this message first, and then any other
-	// messages, including new "firsts".
-	log4cpp::Category &root = log4cpp::Category::getRoot();
-	root.info("Publishing status %s = %s",
-			  topic.str().c_str(), val);
-	int mosqe =
-		mosquitto_publish(bus()->mq(), NULL, topic.str().c_str(),
-						  strlen(val), val, 1, true);
-	mosq_errcheck(mosqe, "mosquitto_publish");
+	bus()->transport()->status(*this, val);
 }
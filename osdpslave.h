@@ -4,6 +4,9 @@
 #include <boost/optional.hpp>
 
 #include <cstring>
+#include <map>
+#include <string>
+#include <vector>
 
 #include "uuid.h"
 
@@ -12,6 +15,79 @@
 
 typedef sync_queue < blob > blobqueue_t;
 
+// A command queued for a slave.  A durable one is also in the bus's
+// journal, as record "journal", until the PD ACKs it.
+struct osdpmsg {
+	blob data;
+	long journal;				// -1 if not durable
+
+	// An MQTT v5 request wants its reply on reply_to (or if that's
+	// empty, the slave's incoming topic) with its correlation data.
+	std::string reply_to;
+	blob correlation;
+	struct timespec queued;		// (CLOCK_REALTIME)
+
+	osdpmsg() : journal(-1), queued{0,0} {}
+	osdpmsg(const blob &b, long j = -1) : data(b), journal(j), queued{0,0} {}
+	inline bool durable(void) const { return journal >= 0; }
+	inline bool correlated(void) const {
+		return !reply_to.empty() || !correlation.isnull();
+	}
+};
+
+typedef sync_queue < osdpmsg > msgqueue_t;
+
+// Priority classes of outgoing command, most urgent first.  A slave
+// sends from the most urgent class that has anything queued, except
+// that a class passed over m_starve times in a row gets a turn.
+typedef enum {
+	MSG_INTERACTIVE,			// LED, BUZ, OUT, TEXT: a person's waiting
+	MSG_NORMAL,
+	MSG_BULK,					// MFG, DATA: transfers
+	MSG_CLASSES					// (how many classes)
+} msgclass_t;
+
+msgclass_t msg_class(const blob &cmd); // (the default, by command code)
+
+// What becomes of a message that would put a queue over its limits
+typedef enum {
+	QUEUE_ADMIT,				// (it's within them)
+	QUEUE_DROP_OLDEST,			// queue it, drop the oldest queued
+	QUEUE_DROP_NEWEST,			// drop it
+	QUEUE_REJECT				// drop it, and publish an error
+} qpolicy_t;
+
+qpolicy_t queue_policy(const char *name); // (QUEUE_ADMIT if unknown)
+
+// What bus time is spent on, for airtime accounting
+typedef enum {
+	AIR_PAYLOAD,				// commands and replies that say something
+	AIR_POLL,					// POLLs and their ACKs
+	AIR_TURNAROUND,				// waiting for a reply that came
+	AIR_DELAY,					// holding off before transmitting
+	AIR_TIMEOUT,				// waiting for a reply that didn't
+	AIR_RETRY,					// exchanges repeating a missed one
+	AIR_PROBE,					// polls of offline slaves
+	AIR_CATEGORIES				// (how many categories)
+} aircat_t;
+
+extern const char *aircat_names[AIR_CATEGORIES];
+
+// A uuid_t in a form that can key a hash table.  UUIDs are random
+// enough that folding the two halves together makes a fine hash.
+struct uuid_key {
+	uint64_t hi, lo;
+	uuid_key(const uuid_t u) {
+		memcpy(&hi, u, sizeof(hi));
+		memcpy(&lo, u + sizeof(hi), sizeof(lo));
+	}
+	bool operator==(const uuid_key &k) const { return hi == k.hi && lo == k.lo; }
+};
+
+struct uuid_key_hash {
+	size_t operator()(const uuid_key &k) const { return (size_t)(k.hi ^ k.lo); }
+};
+
 #define OSDPSLAVE_RETRY_MAX 10
 
 static inline uint8_t next_seq(uint8_t seq) { return (seq == 3) ? 1 : ++seq; }
@@ -22,15 +98,68 @@ public:
 	int16_t m_retry;			// What retry attempt; >0 means do rexmit
 
 	struct timespec m_next_assign; // When to try another assignment
+	long m_probe_ms;			// Current offline-probe backoff
 	struct timespec m_next_poll; // When to try another poll (after a miss)
-
-	blobqueue_t m_msglist;		// Messages for this slave
+	struct timespec m_wire;		// When the last command went out
+								// (CLOCK_REALTIME)
+
+	msgqueue_t m_msglist[MSG_CLASSES]; // Messages for this slave
+	int m_inflight;				// class of the message front() gave,
+								// until it's popped (or -1)
+	int m_inflight_bytes;		// (and its size)
+	int m_passed[MSG_CLASSES];	// times each was passed over for a
+								// more urgent class
+	int m_starve;				// passes before a class gets a turn
+
+	// Backpressure: limits on what may queue for me (0 means no
+	// limit), and what happens to a message over them.
+	katomic_t m_queued;			// messages queued
+	katomic_t m_queued_bytes;
+	size_t m_max_msgs;
+	size_t m_max_bytes;
+	qpolicy_t m_policy;
+	long m_max_latency;			// milliseconds; refuse a message that
+								// won't be sent within this
+	katomic_t m_shed;			// queued messages to drop, for the bus
+	katomic_t m_pinned;			// durable messages queued (never shed)
+	katomic_t m_pinned_bytes;
+	katomic_t m_dropped;
+	katomic_t m_rejected;
+	long m_cycle_us;			// how often I'm polled (moving average)
+	struct timespec m_visited;	// when I was last polled
+
+	long m_airtime[AIR_CATEGORIES]; // MICROseconds of bus time spent on
+									// me, this stats interval
+
+	void dequeued(const osdpmsg &msg);
+	bool over(void) const;		// (shed() isn't done)
+	qpolicy_t shed_or(qpolicy_t policy, size_t msgs, size_t bytes) const;
 
 	uuid_t m_uuid;				// factory-assigned UUID
 	uint8_t m_addr;				// statically- or dynamically-assigned addr
 	uint8_t m_txseq, m_rxseq;
 	bool m_enabled;		  // whether it's enabled (polled, etc)
 	bool m_setrtc;		  // Rather than dequeue from msglist, set RTC
+	long m_reply_us;	  // How fast it answered discovery (0 = unknown;
+						  // else it sets the floor of its probe timeout)
+
+	// Change-only publishing: for the reply codes in here, a reply
+	// identical to the last one published is suppressed, except
+	// that one is let through every m_refresh seconds anyway.
+	struct reply_memo {
+		bool valid;				// data holds the last one published
+		std::vector<uint8_t> data;
+		struct timespec refresh; // when to publish regardless
+	};
+	typedef std::map<uint8_t, reply_memo> memomap_t;
+	memomap_t m_change_only;
+	int m_refresh;				// seconds; 0 means never refresh
+
+	// What to send when the bus's credential cache grants (or
+	// denies) a card I read; nothing configured means I leave the
+	// decision to the app.
+	std::vector<blob> m_grant;
+	std::vector<blob> m_deny;
 
 public:
 	osdpslave(busprotocol *bus);
@@ -38,29 +167,36 @@ public:
 
 	void init(void);
 
-	inline void push(blob msg) {
-		m_msglist.push(msg);
+	void push(const osdpmsg &msg, msgclass_t cls);
+	inline void push(const osdpmsg &msg) {
+		push(msg, msg_class(msg.data));
 	}
 
-	inline bool empty() {
-		return m_msglist.empty();
-	}
-	inline blob front() {
-		blob empty;
-		if(m_msglist.empty())
-		   return empty;
-		return m_msglist.front();
-	}
-	inline void pop() {
-		m_msglist.pop();
-	}
+	// May a message of "bytes" be queued?  If it's over a limit,
+	// returns that limit's policy, and says which limit in *why.
+	qpolicy_t admit(size_t bytes, const char **why);
+	void limits(size_t msgs, size_t bytes, qpolicy_t policy, long latency_ms);
+	void shed(void);			// (bus thread) drop what's over limits
+	void visit(const struct timespec &now); // (bus thread) I'm polled
+	inline void dropped(void) { katomic_inc(&m_dropped); }
+	inline void rejected(void) { katomic_inc(&m_rejected); }
+
+	bool empty();
+	// The message to send next.  It stays the one to send (for
+	// retries) until it's popped, whatever arrives meanwhile.
+	osdpmsg front();
+	void pop();					// the front one's done with
 
-	void set_uuid(uuid_t u) { memcpy(m_uuid, u, sizeof(m_uuid)); }
+	inline void starve(int passes) { m_starve = passes; }
+
+	void set_uuid(const uuid_t u); // (also re-indexes me on my bus)
 	const uuid_t &uuid() const { return m_uuid; }
 	uint8_t addr() const { return m_addr; }
-	uint8_t addr(uint8_t a) { m_addr = a; return a; }
+	uint8_t addr(uint8_t a);	// (also re-indexes me on my bus)
 
 	bool defined() const;
+	// Known by UUID, but discovery hasn't found its address yet?
+	bool addressed() const { return m_addr < 0x7F; }
 
 	bool offline(void) const { return m_retry >= OSDPSLAVE_RETRY_MAX; }
 	void ack(void);				// poll success (slave responded)
@@ -75,9 +211,26 @@ public:
 
 	bool welcome(void);
 
+	// My queue stats and airtime, as JSON.  (Airtime starts a new
+	// interval.)
+	int stats(char *text, size_t size);
+	int airtime(char *text, size_t size);
+
+	void change_only(uint8_t code); // suppress repeats of this reply
+	inline void refresh(int seconds) { m_refresh = seconds; }
+	bool changed(const uint8_t *reply, int len); // should I publish it?
+	void forget_replies(void);	// publish the next of each regardless
+
+	// Commands for a local decision ("grant" or "deny"): hex, one
+	// command per word.  Returns false if one isn't hex.
+	bool decision(const std::string &grant, const std::string &deny);
+	bool decides(void) const { return !m_grant.empty() || !m_deny.empty(); }
+	void decide(bool grant);	// (bus thread) queue them
+
 	void retire(void);
 
-	void purge(void);			// purge queued outgoing
+	void purge(void);			// purge queued outgoing (but durable
+								// ones stay)
 
 	void declare_online(bool tf); // Report to the world whether I'm
 								  // offline or online
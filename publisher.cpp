@@ -0,0 +1,296 @@
+#include <errno.h>
+
+#include <cstring>
+#include <cstdio>
+
+#include "log4cpp.h"
+
+#include "timespec.h"
+#include "osdpdecode.h"
+#include "publisher.h"
+
+// The ring is the classic bounded queue where every slot carries a
+// sequence number: a slot is free for the producer that claims
+// position "pos" when its seq == pos, and holds a publication for the
+// consumer when its seq == pos+1.  Producers claim positions with a
+// compare-and-swap on m_tail; the lone consumer just walks m_head.
+
+pubring::pubring() : m_tail(0), m_head(0) {
+	for(size_t i = 0; i < PUBLISHER_RING_SIZE; i++)
+		m_ring[i].seq.store(i, std::memory_order_relaxed);
+}
+
+bool pubring::push(pubclass_t cls, const char *topic,
+				   const void *payload, int len, bool retain,
+				   const pubcorr *corr, bool decode) {
+	size_t tlen = strlen(topic);
+	if(tlen >= PUBLISHER_TOPIC_SIZE || len < 0 || len > PUBLISHER_PAYLOAD_SIZE)
+		return false;			// won't fit a slot
+	if(corr && corr->len > PUBLISHER_CORR_SIZE)
+		return false;
+
+	size_t pos = m_tail.load(std::memory_order_relaxed);
+	slot *s;
+	for(;;) {
+		s = &m_ring[pos & (PUBLISHER_RING_SIZE-1)];
+		size_t seq = s->seq.load(std::memory_order_acquire);
+		intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+		if(dif == 0) {
+			if(m_tail.compare_exchange_weak(pos, pos+1,
+											std::memory_order_relaxed))
+				break;			// slot is mine
+		}
+		else if(dif < 0)
+			return false;		// full
+		else
+			pos = m_tail.load(std::memory_order_relaxed);
+	}
+
+	s->cls = cls;
+	s->retain = retain;
+	s->decode = decode;
+	s->len = len;
+	clock_gettime(CLOCK_MONOTONIC, &s->queued);
+	memcpy(s->topic, topic, tlen+1);
+	if(len > 0)
+		memcpy(s->payload, payload, len);
+	s->correlated = (corr != NULL);
+	if(corr) {
+		s->corr = *corr;
+		if(corr->data && corr->len > 0)
+			memcpy(s->corr_data, corr->data, corr->len);
+		s->corr.data = s->corr_data;
+	}
+
+	s->seq.store(pos+1, std::memory_order_release); // hand it over
+	return true;
+}
+
+pubring::slot *pubring::front(void) {
+	slot *s = &m_ring[m_head & (PUBLISHER_RING_SIZE-1)];
+	if(s->seq.load(std::memory_order_acquire) != m_head+1)
+		return NULL;			// empty
+	return s;
+}
+
+void pubring::pop(void) {
+	slot *s = &m_ring[m_head & (PUBLISHER_RING_SIZE-1)];
+	s->seq.store(m_head + PUBLISHER_RING_SIZE, std::memory_order_release);
+	m_head++;
+}
+
+publisher::publisher(struct mosquitto *mq)
+	: m_mq(mq), m_v5(false), m_decode(false), m_stats_interval(0), m_dropped(0),
+	  m_published(0), m_errors(0), m_max_depth(0),
+	  m_latency_total(0), m_latency_max(0), m_fast_published(0),
+	  m_fast_latency_total(0), m_fast_latency_max(0) {
+	sem_init(&m_wake, 0, 0);
+	m_qos[PUB_REPLY] = 1;
+	m_qos[PUB_STATUS] = 1;
+	m_qos[PUB_STATS] = 0;
+	m_qos[PUB_CARD] = 1;
+	m_stats_topic[0] = '\0';
+}
+
+publisher::~publisher() {
+	sem_destroy(&m_wake);
+}
+
+void publisher::stats(int interval, const char *topic) {
+	m_stats_interval = interval;
+	snprintf(m_stats_topic, sizeof(m_stats_topic), "%s", topic);
+}
+
+void publisher::start(void) {
+	pthread_create(&m_thread, NULL, thread_main, (void *)this);
+}
+
+void *publisher::thread_main(void *param) {
+	((publisher *)param)->run();
+	return 0;
+}
+
+bool publisher::publish(pubclass_t cls, const char *topic,
+						const void *payload, int len, bool retain) {
+	if(!m_ring.push(cls, topic, payload, len, retain)) {
+		m_dropped++;
+		return false;
+	}
+	sem_post(&m_wake);
+	return true;
+}
+
+bool publisher::publish(pubclass_t cls, const char *topic,
+						const void *payload, int len, const pubcorr &corr) {
+	if(!m_ring.push(cls, topic, payload, len, false, &corr)) {
+		m_dropped++;
+		return false;
+	}
+	sem_post(&m_wake);
+	return true;
+}
+
+bool publisher::reply(const char *topic, const void *payload, int len) {
+	if(!m_ring.push(PUB_REPLY, topic, payload, len, false, NULL, m_decode)) {
+		m_dropped++;
+		return false;
+	}
+	sem_post(&m_wake);
+	return true;
+}
+
+bool publisher::fast(const char *topic, const void *payload, int len) {
+	if(!m_fast.push(PUB_CARD, topic, payload, len, false, NULL, m_decode)) {
+		m_dropped++;
+		return false;
+	}
+	sem_post(&m_wake);
+	return true;
+}
+
+bool publisher::decision(const char *topic, const char *json, int len) {
+	if(!m_fast.push(PUB_CARD, topic, json, len, false, NULL, false)) {
+		m_dropped++;
+		return false;
+	}
+	sem_post(&m_wake);
+	return true;
+}
+
+static void add_time(mosquitto_property **props, const char *name,
+					 const struct timespec &t) {
+	char text[24];				// microseconds since the epoch
+	snprintf(text, sizeof(text), "%lld",
+			 (long long)t.tv_sec * 1000000 + t.tv_nsec / 1000);
+	mosquitto_property_add_string_pair(props, MQTT_PROP_USER_PROPERTY,
+									   name, text);
+}
+
+void publisher::send(pubring::slot &p) {
+	int mosqe;
+	if(p.correlated && m_v5) {
+		mosquitto_property *props = NULL;
+		if(p.corr.len > 0)
+			mosquitto_property_add_binary(&props, MQTT_PROP_CORRELATION_DATA,
+										  p.corr.data, p.corr.len);
+		add_time(&props, "queued_us", p.corr.queued);
+		add_time(&props, "wire_us", p.corr.wire);
+		add_time(&props, "reply_us", p.corr.reply);
+		mosqe = mosquitto_publish_v5(m_mq, NULL, p.topic, p.len, p.payload,
+									 m_qos[p.cls], p.retain, props);
+		mosquitto_property_free_all(&props);
+	}
+	else
+		mosqe = mosquitto_publish(m_mq, NULL, p.topic, p.len, p.payload,
+								  m_qos[p.cls], p.retain);
+	mosq_errcheck(mosqe, "mosquitto_publish");
+	if(mosqe != MOSQ_ERR_SUCCESS)
+		m_errors++;
+
+	if(p.decode) {
+		// (on my thread, so decoding never slows the bus)
+		char topic[PUBLISHER_TOPIC_SIZE + 8];
+		char json[OSDP_DECODE_MAX(PUBLISHER_PAYLOAD_SIZE)];
+		int len = osdp_decode(p.payload, p.len, json, sizeof(json));
+		if(len >= (int)sizeof(json)) {
+			// (Can't happen; but cut short, it's not JSON)
+			log4cpp::Category &root = log4cpp::Category::getRoot();
+			root.error("Decoded %s too long", p.topic);
+			m_errors++;
+		}
+		else if(len > 0) {
+			snprintf(topic, sizeof(topic), "%s/decoded", p.topic);
+			mosqe = mosquitto_publish(m_mq, NULL, topic, len, json,
+									  m_qos[p.cls], false);
+			mosq_errcheck(mosqe, "mosquitto_publish");
+			if(mosqe != MOSQ_ERR_SUCCESS)
+				m_errors++;
+		}
+	}
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	struct timespec waited = now - p.queued;
+	long us = waited.tv_sec * 1000000 + waited.tv_nsec / 1000;
+	m_latency_total += us;
+	if(us > m_latency_max)
+		m_latency_max = us;
+	m_published++;
+	if(p.cls == PUB_CARD) {
+		// (read-to-publish, near enough: it's pushed as it's read)
+		m_fast_latency_total += us;
+		if(us > m_fast_latency_max)
+			m_fast_latency_max = us;
+		m_fast_published++;
+	}
+}
+
+void publisher::report(void) {
+	char text[384];
+	int len = snprintf(text, sizeof(text),
+					   "{\"depth\":%zu,\"max_depth\":%zu,"
+					   "\"published\":%lu,\"dropped\":%lu,\"errors\":%lu,"
+					   "\"latency_avg_us\":%ld,\"latency_max_us\":%ld,"
+					   "\"card_published\":%lu,"
+					   "\"card_latency_avg_us\":%ld,\"card_latency_max_us\":%ld}",
+					   m_ring.depth(), m_max_depth,
+					   m_published, m_dropped.load(), m_errors,
+					   m_published ? m_latency_total / (long)m_published : 0L,
+					   m_latency_max, m_fast_published,
+					   m_fast_published ?
+					   m_fast_latency_total / (long)m_fast_published : 0L,
+					   m_fast_latency_max);
+	// Straight out, not through the ring; I *am* the ring's reader.
+	int mosqe = mosquitto_publish(m_mq, NULL, m_stats_topic, len, text,
+								  m_qos[PUB_STATS], false);
+	mosq_errcheck(mosqe, "mosquitto_publish");
+
+	// Start the next interval's peaks fresh
+	m_max_depth = 0;
+	m_latency_max = 0;
+	m_fast_latency_max = 0;
+}
+
+void publisher::run(void) {
+	struct timespec next_report;
+	clock_gettime(CLOCK_REALTIME, &next_report);
+	next_report.tv_sec += m_stats_interval;
+
+	for(;;) {
+		int i;
+		if(m_stats_interval > 0)
+			i = sem_timedwait(&m_wake, &next_report);
+		else
+			i = sem_wait(&m_wake);
+		if(i < 0 && errno == EINTR)
+			continue;
+
+		size_t depth = m_ring.depth();
+		if(depth > m_max_depth)
+			m_max_depth = depth;
+
+		// The fast lane goes first, and gets another look between
+		// each of the others.
+		pubring::slot *p;
+		for(;;) {
+			while((p = m_fast.front()) != NULL) {
+				send(*p);
+				m_fast.pop();
+			}
+			if((p = m_ring.front()) == NULL)
+				break;
+			send(*p);
+			m_ring.pop();
+		}
+
+		if(m_stats_interval > 0) {
+			struct timespec now;
+			clock_gettime(CLOCK_REALTIME, &now);
+			if(now >= next_report) {
+				report();
+				next_report = now;
+				next_report.tv_sec += m_stats_interval;
+			}
+		}
+	}
+}
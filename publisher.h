@@ -0,0 +1,145 @@
+#ifndef PUBLISHER_H
+#define PUBLISHER_H
+
+// The publisher owns every call to mosquitto_publish.  Other threads
+// (chiefly the bus thread) hand it publications through a lock-free
+// ring, so a stalled broker connection never stalls bus polling.
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <time.h>
+
+#include <atomic>
+#include <cstdint>
+
+#include <mosquitto.h>
+
+#define PUBLISHER_RING_SIZE 256	// slots; must be a power of 2
+#define PUBLISHER_TOPIC_SIZE 128 // (MQTT v5 response topics can be long)
+#define PUBLISHER_PAYLOAD_SIZE 288 // room for the largest OSDP reply
+#define PUBLISHER_CORR_SIZE 64	// correlation data
+
+// Classes of publication.  Each class has its own QoS.
+typedef enum {
+	PUB_REPLY,					// PD replies
+	PUB_STATUS,					// ONLINE/OFFLINE/DISABLED (retained)
+	PUB_STATS,					// counters and metrics
+	PUB_CARD,					// card reads and keypresses (fast lane)
+	PUB_CLASSES					// (how many classes)
+} pubclass_t;
+
+// A reply to an MQTT v5 request goes out with the request's
+// correlation data, and user properties saying when the command was
+// queued, went on the wire, and was answered.
+struct pubcorr {
+	const void *data;			// correlation data (NULL if none)
+	int len;
+	struct timespec queued, wire, reply; // (CLOCK_REALTIME)
+};
+
+// A bounded multiple-producer, single-consumer ring of publications.
+// Producers never block; when the ring is full, push() fails.
+class pubring {
+public:
+	struct slot {
+		std::atomic<size_t> seq; // ring-position bookkeeping
+		pubclass_t cls;
+		bool retain;
+		bool decode;			// a PD reply (to decode, if I do)
+		uint16_t len;
+		struct timespec queued;	// when it was pushed
+		char topic[PUBLISHER_TOPIC_SIZE];
+		uint8_t payload[PUBLISHER_PAYLOAD_SIZE];
+		bool correlated;		// corr holds a pubcorr's worth
+		struct pubcorr corr;	// (corr.data points at corr_data)
+		uint8_t corr_data[PUBLISHER_CORR_SIZE];
+	};
+
+protected:
+	slot m_ring[PUBLISHER_RING_SIZE];
+	std::atomic<size_t> m_tail;	// next position to push
+	size_t m_head;				// next position to pop (consumer only)
+
+public:
+	pubring();
+
+	bool push(pubclass_t cls, const char *topic,
+			  const void *payload, int len, bool retain,
+			  const pubcorr *corr = NULL, bool decode = false);
+
+	slot *front(void);			// consumer: oldest slot, or NULL
+	void pop(void);				// consumer: done with front()
+
+	inline size_t depth(void) const {
+		return m_tail.load(std::memory_order_relaxed) - m_head;
+	}
+};
+
+class publisher {
+protected:
+	struct mosquitto *m_mq;
+	pubring m_ring;
+	pubring m_fast;				// jumps ahead of m_ring
+	sem_t m_wake;				// posted once per push
+	pthread_t m_thread;
+
+	int m_qos[PUB_CLASSES];		// QoS for each class of publication
+	bool m_v5;					// connected with MQTT v5 (properties ok)
+	bool m_decode;				// also publish replies decoded, as JSON
+
+	// Metrics, published every m_stats_interval seconds
+	int m_stats_interval;
+	char m_stats_topic[PUBLISHER_TOPIC_SIZE];
+	std::atomic<unsigned long> m_dropped; // pushes refused, ring full
+	unsigned long m_published;
+	unsigned long m_errors;
+	size_t m_max_depth;
+	long m_latency_total;		// microseconds queued-to-published
+	long m_latency_max;
+	unsigned long m_fast_published; // (and the same for the fast lane)
+	long m_fast_latency_total;
+	long m_fast_latency_max;
+
+	static void *thread_main(void *param);
+	void run(void);
+	void send(pubring::slot &p);
+	void report(void);
+
+public:
+	publisher(struct mosquitto *mq);
+	~publisher();
+
+	void start(void);
+
+	// Queue a publication; returns false (and counts a drop) if
+	// the ring is full.
+	bool publish(pubclass_t cls, const char *topic,
+				 const void *payload, int len, bool retain = false);
+	// ...a reply to a correlated request
+	bool publish(pubclass_t cls, const char *topic,
+				 const void *payload, int len, const pubcorr &corr);
+	// ...a PD reply, which (if I'm decoding) also goes out as JSON
+	// on "<topic>/decoded"
+	bool reply(const char *topic, const void *payload, int len);
+	// ...a card read or keypress, ahead of everything else
+	bool fast(const char *topic, const void *payload, int len);
+	// ...a local access decision: as quick, but JSON already (so
+	// never decoded)
+	bool decision(const char *topic, const char *json, int len);
+
+	inline int qos(pubclass_t cls) const { return m_qos[cls]; }
+	inline void qos(pubclass_t cls, int q) { m_qos[cls] = q; }
+
+	inline bool v5(void) const { return m_v5; }
+	inline void v5(bool yn) { m_v5 = yn; }
+
+	inline void decode(bool yn) { m_decode = yn; }
+
+	void stats(int interval, const char *topic);
+
+	inline struct mosquitto *mq(void) { return m_mq; }
+};
+
+void mosq_errcheck(int mosqe, const char *context);
+
+#endif // PUBLISHER_H
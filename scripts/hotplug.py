@@ -0,0 +1,124 @@
+#!/usr/bin/python3
+
+# Unplug and replug a (fake) serial adapter, to watch osdpmaster reopen
+# its port when the device node comes back.  Answers as a PD on a pty
+# linked at <path> (point [port] device there), removes the link after
+# <down> seconds and puts a new pty there <up> seconds later.  Prints
+# the PD's status changes, and how long it took to come back ONLINE.
+
+# args: <path> <addr> [down] [up]
+
+import sys, os, pty, tty, select, time
+
+import paho.mqtt.client as mqtt
+
+path = sys.argv[1]
+addr = int(sys.argv[2])
+down = float(sys.argv[3]) if len(sys.argv) > 3 else 5
+up = float(sys.argv[4]) if len(sys.argv) > 4 else down + 5
+
+start = time.time()
+replugged = None
+
+def crc16(data):
+    crc = 0x1D0F
+    for b in data:
+        x = ((crc >> 8) ^ b) & 0xFF
+        x ^= x >> 4
+        crc = ((crc << 8) ^ (x << 12) ^ (x << 5) ^ x) & 0xFFFF
+    return crc
+
+def frame(seq, payload):
+    f = bytes([0x53, addr | 0x80, (len(payload) + 7) & 0xFF,
+               (len(payload) + 7) >> 8, seq | 4]) + payload
+    c = crc16(f)
+    return f + bytes([c & 0xFF, c >> 8])
+
+def plug():
+    master, slave = pty.openpty()
+    tty.setraw(slave)
+    if os.path.lexists(path):
+        os.unlink(path)
+    os.symlink(os.ttyname(slave), path)
+    return master, slave
+
+def unplug(fds):
+    os.unlink(path)
+    for fd in fds:
+        os.close(fd)
+
+def on_connect(client, userdata, flags, rc):
+    print('MQTT connected, flags', flags, 'rc', mqtt.connack_string(rc))
+    client.subscribe("osdpiom/bus1/incoming/{0}/status".format(addr))
+
+def on_message(client, userdata, message):
+    now = time.time()
+    status = message.payload.decode('ascii')
+    print("{0:8.3f} {1}".format(now - start, status))
+    if replugged and status == "ONLINE":
+        print("back {0:.0f} ms after the replug".format((now - replugged) * 1000))
+
+client = mqtt.Client()
+client.on_connect = on_connect
+client.on_message = on_message
+
+client.username_pw_set("scripts", "scripts")
+
+mqtthost = "localhost"
+if "MQTT_SERVER" in os.environ:
+    mqtthost = os.getenv("MQTT_SERVER")
+
+client.connect(mqtthost, 1883, 60)
+client.loop_start()
+
+fds = plug()
+buf = b''
+print("{0:8.3f} plugged in at {1}".format(0, path))
+while replugged is None or time.time() - replugged < 10:
+    now = time.time() - start
+    if fds and now >= down and replugged is None:
+        unplug(fds)
+        fds = None
+        print("{0:8.3f} unplugged".format(now))
+    elif fds is None and now >= up:
+        fds = plug()
+        buf = b''
+        replugged = time.time()
+        print("{0:8.3f} plugged in again".format(now))
+
+    if fds is None:
+        time.sleep(0.05)
+        continue
+    r, _, _ = select.select([fds[0]], [], [], 0.05)
+    if not r:
+        continue
+    try:
+        buf += os.read(fds[0], 4096)
+    except OSError:
+        continue                # (nobody has it open)
+
+    # Answer each command to me: ID with a PDID, anything else an ACK
+    while True:
+        i = buf.find(b'\x53')
+        if i < 0:
+            buf = b''
+            break
+        buf = buf[i:]
+        if len(buf) < 5:
+            break
+        length = buf[2] | buf[3] << 8
+        if len(buf) < length:
+            break
+        f = buf[:length]
+        buf = buf[length:]
+        if length < 8 or crc16(f[:-2]) != (f[-2] | f[-1] << 8):
+            continue
+        if (f[1] & 0x7F) != addr:
+            continue
+        reply = bytes([0x40])   # osdp_ACK
+        if f[5] == 0x61:        # osdp_ID
+            reply = bytes([0x45, 0x00, 0x0B, 0x5A, 1, 1, addr, 0, 0, 0, 1, 0, 0])
+        os.write(fds[0], frame(f[4] & 3, reply))
+
+unplug(fds)
+client.loop_stop()
@@ -0,0 +1,94 @@
+#include <sys/stat.h>
+#include <time.h>
+
+#include <cerrno>
+#include <cstring>
+
+#include "log4cpp.h"
+
+#include "shmtransport.h"
+
+shmtransport::shmtransport()
+	: m_shm(NULL) {
+	m_name[0] = '\0';
+}
+
+shmtransport::~shmtransport() {
+	if(m_shm) {
+		munmap(m_shm, sizeof(struct osdpshm));
+		shm_unlink(m_name);
+	}
+}
+
+bool shmtransport::open(int bus) {
+	log4cpp::Category &root = log4cpp::Category::getRoot();
+
+	// Start afresh: clients of an earlier me have to reopen anyway
+	osdpshm_name(bus, m_name, sizeof(m_name));
+	shm_unlink(m_name);
+	int fd = shm_open(m_name, O_RDWR|O_CREAT|O_EXCL, 0660);
+	if(fd < 0) {
+		root.error("shm %s: can't create it, errno %d", m_name, errno);
+		return false;
+	}
+	if(ftruncate(fd, sizeof(struct osdpshm)) < 0) {
+		root.error("shm %s: can't size it, errno %d", m_name, errno);
+		::close(fd);
+		return false;
+	}
+	void *p = mmap(NULL, sizeof(struct osdpshm), PROT_READ|PROT_WRITE,
+				   MAP_SHARED, fd, 0);
+	::close(fd);
+	if(p == MAP_FAILED) {
+		root.error("shm %s: mmap failed, errno %d", m_name, errno);
+		return false;
+	}
+	m_shm = (struct osdpshm *)p;
+
+	// (ftruncate zeroed it)
+	m_shm->version = OSDPSHM_VERSION;
+	m_shm->frames = OSDPSHM_FRAMES;
+	m_shm->commands = OSDPSHM_COMMANDS;
+	for(uint64_t i = 0; i < OSDPSHM_COMMANDS; i++)
+		m_shm->command[i].seq = i;
+	__atomic_store_n(&m_shm->magic, OSDPSHM_MAGIC, __ATOMIC_RELEASE);
+
+	root.info("shm %s: %zu bytes", m_name, sizeof(struct osdpshm));
+	return true;
+}
+
+void shmtransport::frame(uint8_t addr, const void *data, int len) {
+	if(m_shm == NULL || len <= 0 || len > OSDPSHM_FRAME_DATA)
+		return;
+	uint64_t n = m_shm->frame_tail;	// (I'm the only writer)
+	struct osdpshm_frame *f = &m_shm->frame[n & (OSDPSHM_FRAMES-1)];
+
+	// A reader that sees seq change under it knows to discard its copy
+	__atomic_store_n(&f->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	f->stamp_ns = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+	f->addr = addr;
+	f->len = len;
+	memcpy(f->data, data, len);
+	__atomic_store_n(&f->seq, n+1, __ATOMIC_RELEASE);
+	__atomic_store_n(&m_shm->frame_tail, n+1, __ATOMIC_RELEASE);
+}
+
+struct osdpshm_command *shmtransport::command(void) {
+	if(m_shm == NULL)
+		return NULL;
+	uint64_t head = m_shm->command_head;
+	struct osdpshm_command *c = &m_shm->command[head & (OSDPSHM_COMMANDS-1)];
+	if(__atomic_load_n(&c->seq, __ATOMIC_ACQUIRE) != head+1)
+		return NULL;			// empty
+	return c;
+}
+
+void shmtransport::done(void) {
+	uint64_t head = m_shm->command_head;
+	struct osdpshm_command *c = &m_shm->command[head & (OSDPSHM_COMMANDS-1)];
+	__atomic_store_n(&c->seq, head + OSDPSHM_COMMANDS, __ATOMIC_RELEASE);
+	__atomic_store_n(&m_shm->command_head, head+1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,32 @@
+#ifndef SHMTRANSPORT_H
+#define SHMTRANSPORT_H
+
+// My side of the shared-memory interface in osdpshm.h: I make the
+// segment, write the frames, and take the commands.  All of it's done
+// on the bus thread, so each ring has just the one writer (or reader)
+// on my side.
+
+#include <cstdint>
+
+#include "osdpshm.h"
+
+class shmtransport {
+protected:
+	struct osdpshm *m_shm;
+	char m_name[32];
+
+public:
+	shmtransport();
+	~shmtransport();
+
+	// Make (or remake) bus <n>'s segment.  Returns false (having
+	// logged why) if it can't.
+	bool open(int bus);
+
+	void frame(uint8_t addr, const void *data, int len);
+
+	struct osdpshm_command *command(void); // the next one, or NULL
+	void done(void);			// finished with command()
+};
+
+#endif // SHMTRANSPORT_H
@@ -10,7 +10,7 @@ protected:
 	pthread_mutex_t m_lock;
 	pthread_cond_t m_signal;
 public:
-	sync_queue<MEMB>() {
+	sync_queue() {
 		pthread_mutex_init(&m_lock, NULL);
 		// cond init is a little spicier, I need to specify
 		// that timedwait operations are based on
@@ -51,6 +51,25 @@ public:
 		super::pop();
 		pthread_mutex_unlock(&m_lock);
 	}
+	// Remove, oldest first, each member drop() says to (but not the
+	// first "keep"), all under the lock; returns how many went
+	template <class PRED> size_t remove_if(PRED drop, size_t keep = 0) {
+		pthread_mutex_lock(&m_lock);
+		size_t n = 0;
+		auto i = super::c.begin();
+		for(; keep > 0 && i != super::c.end(); keep--)
+			i++;
+		while(i != super::c.end()) {
+			if(drop(*i)) {
+				i = super::c.erase(i);
+				n++;
+			}
+			else
+				i++;
+		}
+		pthread_mutex_unlock(&m_lock);
+		return n;
+	}
 	bool wait(uint32_t ms) {
 		struct timespec ts;
 		clock_gettime(CLOCK_MONOTONIC, &ts);
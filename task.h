@@ -0,0 +1,105 @@
+#ifndef TASK_H
+#define TASK_H
+
+// Coroutines for the bus engine (see busloop.h).  A task<T> is a
+// coroutine returning T; it starts when it's co_awaited, and when it
+// finishes, whoever co_awaited it carries on (directly: no trip
+// through the loop).  Exceptions come out of the co_await, as from a
+// plain call.  The outermost task of each chain is given to
+// busloop::spawn(), which starts it and holds it until it's done.
+
+#include <coroutine>
+#include <exception>
+#include <utility>
+
+template <class T> class task;
+
+// What task<T>'s promises have in common
+struct task_promise_base {
+	std::coroutine_handle<> m_continuation; // who co_awaited me (or none)
+	std::exception_ptr m_error;
+
+	// At the end, go back to whoever co_awaited me
+	struct final_awaiter {
+		bool await_ready() noexcept { return false; }
+		template <class P>
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept {
+			std::coroutine_handle<> c = h.promise().m_continuation;
+			return c ? c : std::noop_coroutine();
+		}
+		void await_resume() noexcept {}
+	};
+
+	std::suspend_always initial_suspend() noexcept { return {}; }
+	final_awaiter final_suspend() noexcept { return {}; }
+	void unhandled_exception() { m_error = std::current_exception(); }
+};
+
+template <class T> struct task_promise: task_promise_base {
+	T m_value;
+	task<T> get_return_object();
+	void return_value(T v) { m_value = std::move(v); }
+	T result(void) {
+		if(m_error)
+			std::rethrow_exception(m_error);
+		return std::move(m_value);
+	}
+};
+
+template <> struct task_promise<void>: task_promise_base {
+	task<void> get_return_object();
+	void return_void() {}
+	void result(void) {
+		if(m_error)
+			std::rethrow_exception(m_error);
+	}
+};
+
+template <class T = void> class task {
+public:
+	typedef task_promise<T> promise_type;
+	typedef std::coroutine_handle<promise_type> handle;
+
+protected:
+	handle m_h;
+
+public:
+	explicit task(handle h): m_h(h) {}
+	task(task &&from): m_h(std::exchange(from.m_h, nullptr)) {}
+	task &operator=(task &&from) {
+		if(this != &from) {
+			if(m_h)
+				m_h.destroy();
+			m_h = std::exchange(from.m_h, nullptr);
+		}
+		return *this;
+	}
+	task(const task &) = delete;
+	task &operator=(const task &) = delete;
+	~task() {
+		if(m_h)
+			m_h.destroy();
+	}
+
+	// co_await: run it (now), and carry on with its result when it's done
+	bool await_ready() const noexcept { return false; }
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) noexcept {
+		m_h.promise().m_continuation = caller;
+		return m_h;
+	}
+	T await_resume() { return m_h.promise().result(); }
+
+	// (for busloop::spawn)
+	inline handle coroutine(void) const { return m_h; }
+	inline bool done(void) const { return !m_h || m_h.done(); }
+};
+
+template <class T> inline task<T> task_promise<T>::get_return_object() {
+	return task<T>(task<T>::handle::from_promise(*this));
+}
+
+inline task<void> task_promise<void>::get_return_object() {
+	return task<void>(task<void>::handle::from_promise(*this));
+}
+
+#endif // TASK_H
@@ -64,4 +64,15 @@ static inline struct timespec &operator+=(struct timespec &ts, const long interv
 	return ts;
 }
 
+static inline struct timespec &add_us(struct timespec &ts, const long us) {
+	ts.tv_sec += us / 1000000;
+	ts.tv_nsec += (us % 1000000) * 1000;
+	if(ts.tv_nsec >= 1000000000)
+	{
+		ts.tv_nsec -= 1000000000;
+		ts.tv_sec++;
+	}
+	return ts;
+}
+
 #endif // TIMESPEC_H
@@ -0,0 +1,66 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+// How the bus engine tells the world what's happening.  It calls
+// these on its own thread, as things happen, so an implementation
+// must hand them on without holding the bus up (osdpmaster's queues
+// them for its MQTT publisher thread).  (status() and rejected() can
+// also come from a thread that submits commands.)  Commands come the
+// other way, through busprotocol::submit().
+
+#include <cstdint>
+
+class osdpslave;
+struct osdpmsg;
+
+class transport {
+public:
+	virtual ~transport() {}
+
+	// A PD's reply, from its code on.  (Not ACKs, and change_only
+	// replies only when they change.)
+	virtual void reply(osdpslave &s, const uint8_t *reply, int len) = 0;
+
+	// A card read or keypress, to go ahead of anything else waiting
+	virtual void card(osdpslave &s, const uint8_t *reply, int len) = 0;
+
+	// The reply (ACK or not) to a request that wants one back
+	// (request.correlated()).  If its reply_to is empty, this is
+	// instead of reply().
+	virtual void answer(osdpslave &s, const osdpmsg &request,
+						const uint8_t *reply, int len) = 0;
+
+	// "ONLINE", "OFFLINE" or "DISABLED"
+	virtual void status(osdpslave &s, const char *status) = 0;
+
+	// The credential cache granted (or denied) a card s read
+	virtual void decided(osdpslave &s, const uint8_t *card, int len,
+						 bool grant) = 0;
+
+	// A command refused by a queue limit ("limit" says which), or
+	// because its reply couldn't be sent back as asked (a response
+	// topic or correlation data too long: "limit" is "reply_to" or
+	// "correlation")
+	virtual void rejected(osdpslave &s, const char *limit, long mid) = 0;
+
+	// (Monitor mode) a frame someone else's CP or PD sent, from its
+	// code on (just the start of it, if it was too long to keep)
+	virtual void monitored(uint8_t addr, bool pd,
+						   const uint8_t *frame, int len) = 0;
+
+	// Discovery results, as JSON: what answered at "addr", or (addr
+	// -1) how a whole pass went
+	virtual void discovered(int addr, const char *json, int len) = 0;
+
+	// Stats and other news of the bus, as JSON, by kind: "stats",
+	// "journal", "port", "latency_check", "failover", or "monitor"
+	// (for which addr, if not -1, is the address the monitor's stats
+	// are about)
+	virtual void report(const char *kind, int addr,
+						const char *json, int len) = 0;
+	// ...or of one slave: "stats", or "file" (a file transfer's end)
+	virtual void report(osdpslave &s, const char *kind,
+						const char *json, int len) = 0;
+};
+
+#endif // TRANSPORT_H